@@ -0,0 +1,97 @@
+#ifndef ALLOC_H
+#define ALLOC_H
+
+/* Heap allocation counting.
+   The global operator new is replaced so every allocation is counted, in total and per thread for
+   the threads that register. A data path thread marks the end of its start-up with
+   thread_warmed_up; what it allocates after that is reported to the monitor, and should stay at 0.
+   Threads that never call it (control, cleanup, relay...) allocate freely. */
+
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <new>
+
+std::atomic<uint64_t> allocations(0);     // Calls to operator new since the process started
+std::atomic<uint64_t> allocated_bytes(0);  // Bytes asked for in those calls
+
+struct ThreadAllocations {
+    char name[16];                     // função do thread
+    std::atomic<uint64_t> count{0};    // alocações feitas pelo thread
+    std::atomic<int64_t> baseline{-1}; // alocações no fim do arranque (-1 = ainda a arrancar)
+};
+
+const int MAX_COUNTED_THREADS = 64;
+ThreadAllocations counted_threads[MAX_COUNTED_THREADS];
+std::atomic<int> n_counted_threads(0);
+std::mutex counted_threads_mutex;  // Serializes registration
+thread_local ThreadAllocations* thread_allocations = nullptr;
+
+// Not inlined, so the compiler doesn't see new paired with free (it would warn about every delete)
+__attribute__((noinline)) void* operator new(size_t size) {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    allocated_bytes.fetch_add(size, std::memory_order_relaxed);
+    if (thread_allocations != nullptr) {
+        thread_allocations->count.fetch_add(1, std::memory_order_relaxed);
+    }
+    void* memory = malloc(size == 0 ? 1 : size);
+    if (memory == nullptr) {
+        throw std::bad_alloc();
+    }
+    return memory;
+}
+
+__attribute__((noinline)) void* operator new[](size_t size) {
+    return operator new(size);
+}
+
+__attribute__((noinline)) void operator delete(void* memory) noexcept {
+    free(memory);
+}
+
+__attribute__((noinline)) void operator delete[](void* memory) noexcept {
+    free(memory);
+}
+
+__attribute__((noinline)) void operator delete(void* memory, size_t) noexcept {
+    free(memory);
+}
+
+__attribute__((noinline)) void operator delete[](void* memory, size_t) noexcept {
+    free(memory);
+}
+
+void count_thread_allocations(const char* name) {  // Called once at the top of a thread
+    std::lock_guard<std::mutex> lock(counted_threads_mutex);
+    int n = n_counted_threads.load();
+    if (n == MAX_COUNTED_THREADS || thread_allocations != nullptr) {
+        return;  // Later threads are only counted in the total
+    }
+    ThreadAllocations& counted = counted_threads[n];
+    memset(counted.name, 0, sizeof(counted.name));
+    memcpy(counted.name, name, strnlen(name, sizeof(counted.name) - 1));
+    thread_allocations = &counted;
+    n_counted_threads.store(n + 1);
+}
+
+void thread_warmed_up() {  // The calling thread enters its steady state: it should not allocate from now on
+    if (thread_allocations != nullptr) {
+        thread_allocations->baseline.store(thread_allocations->count.load());
+    }
+}
+
+uint64_t data_path_allocations() {  // Allocations made by the warmed up threads since they warmed up
+    uint64_t total = 0;
+    int n = n_counted_threads.load();
+    for (int k = 0; k < n; k++) {
+        const ThreadAllocations& counted = counted_threads[k];
+        int64_t baseline = counted.baseline.load();
+        if (baseline >= 0) {
+            total += counted.count.load() - baseline;
+        }
+    }
+    return total;
+}
+
+#endif
@@ -5,7 +5,10 @@
 #include <conio.h>
 #else
 #include <arpa/inet.h>
+#include <fcntl.h>
 #include <netinet/in.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/ioctl.h>
 #include <sys/select.h>
 #include <sys/socket.h>
@@ -14,15 +17,20 @@
 #include <unistd.h>
 #endif
 
+#include <algorithm>
 #include <atomic>
 #include <chrono>
 #include <cmath>
 #include <condition_variable>
+#include <cstdint>
 #include <csignal>
 #include <cstring>
+#include <deque>
 #include <filesystem>
 #include <fstream>
 #include <iostream>
+#include <map>
+#include <memory>
 #include <mutex>
 #include <set>
 #include <shared_mutex>
@@ -48,6 +56,7 @@ struct Subscriber {
 
 struct PDU_1 {
     char identifier[10];                              // identificador de fonte
+    uint32_t handle;                                  // handle atribuído pelo SM no registo (0 = por registar)
     int i;                                            // número para criar uma amostra
     int value;                                        // amostra
     int period;                                       // período atual
@@ -58,17 +67,76 @@ struct PDU_1 {
     bool sent;                                        // campo para saber se o PDU foi enviado
 };
 
+struct View {
+    uint32_t decimation;  // entregar uma em cada decimation amostras (0 ou 1 = todas)
+    uint32_t window_ms;   // agregar as amostras em janelas de window_ms (0 = sem agregação)
+
+    bool operator==(const View& other) const { return decimation == other.decimation && window_ms == other.window_ms; }
+};
+
+struct Aggregate {
+    int min;           // menor amostra da janela
+    int max;           // maior amostra da janela
+    double avg;        // média das amostras da janela
+    uint32_t samples;  // amostras na janela (0 = PDU sem agregação)
+};
+
+struct Filter {
+    uint32_t deadband;      // entregar só se |valor - último entregue| >= deadband (0 = sempre, 1 = quando muda)
+    uint32_t heartbeat_ms;  // entregar mesmo sem alteração se nada foi entregue há heartbeat_ms (0 = nunca)
+};
+
+struct Replay {
+    int64_t from_ms;  // início do intervalo a repetir (ms desde a época)
+    int64_t to_ms;    // fim do intervalo a repetir (ms desde a época)
+    uint32_t speed;   // vezes mais rápido que o tempo real (0 = o mais depressa possível)
+};
+
 struct PDU_2 {
     int id;                   // identificador do comando (request do cliente)
+    uint32_t req_id;          // identificador do pedido, devolvido na resposta (0 = dados)
     char type[5];             // tipo de request (relacionado com o comando)
     char active_sources[10];  // lista de fontes ativas
     PDU_1 pdu;
     Subscriber sub;
+    View view;                // vista pedida no play (e a que os dados pertencem)
+    Aggregate aggregate;      // resumo da janela (só quando view.window_ms > 0)
+    Filter filter;            // quando entregar as amostras da vista (pedido no play)
+    Replay replay;            // intervalo gravado a repetir (pedido 10)
+};
+
+const int CATALOG_PAGE_SIZE = 48;  // entradas do catálogo por datagrama
+
+struct CatalogEntry {
+    char identifier[10];  // identificador de fonte
+    uint8_t removed;      // 1 se a fonte deixou de estar ativa (só em alterações)
+};
+
+struct PDU_4 {
+    int id;                    // 7 = página do catálogo, 8 = alterações desde uma versão
+    uint32_t req_id;           // identificador do pedido, devolvido na resposta
+    char client_id[10];        // identificador do cliente
+    char cursor[10];           // página: continuar após esta fonte ("" = início)
+    uint64_t version;          // pedido: versão já conhecida; resposta: versão até onde vai a resposta
+    uint8_t more;              // 1 se há mais entradas a pedir
+    uint8_t reset;             // 1 se o histórico já não chega à versão pedida (listar de novo)
+    uint16_t count;            // número de entradas válidas
+    CatalogEntry entries[CATALOG_PAGE_SIZE];
 };
 
 struct PDU_3 {
     int n_subscribers;  // número de subscritores ativos
     int n_sources;      // número de fontes ativas
+    uint64_t egress_sent;          // PDUs de dados enviados aos clientes
+    uint64_t egress_dropped;       // PDUs descartados (fila cheia, política drop-oldest)
+    uint64_t egress_coalesced;     // PDUs substituídos por uma amostra mais recente (política coalesce)
+    uint64_t egress_disconnected;  // clientes desligados por não acompanharem (política disconnect)
+    uint64_t egress_eagain;        // vezes que o socket de envio ficou cheio
+    uint64_t egress_errors;        // envios falhados (e.g. destino inalcançável)
+    uint64_t admission_rejected;     // amostras de fontes novas, clientes e subscrições recusados por falta de capacidade
+    uint64_t requests_dropped;       // pedidos descartados com a fila de pedidos cheia
+    uint64_t allocations;            // alocações de memória desde o arranque (todos os threads)
+    uint64_t data_path_allocations;  // alocações dos threads de dados depois do arranque (deve ser 0)
 };
 
 // Helper lambda function to print key-value pairs
@@ -97,6 +165,7 @@ void create_receiver_socket(int port, int& sockfd, struct sockaddr_in& adrr) {
     // Create a UDP socket
     if ((sockfd = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
         std::cerr << "Failed to create socket." << std::endl;
+        sockfd = -1;
         return;
     }
     // Set up the address and port
@@ -106,14 +175,16 @@ void create_receiver_socket(int port, int& sockfd, struct sockaddr_in& adrr) {
     adrr.sin_addr.s_addr = htonl(INADDR_ANY);  // Listen on all network interfaces
 
     if (bind(sockfd, (struct sockaddr*)&adrr, sizeof(adrr)) < 0) {
-        std::cerr << "Failed to bind socket." << std::endl;
+        std::cerr << "Failed to bind socket to port " << port << "." << std::endl;
         close(sockfd);
+        sockfd = -1;  // Lets the caller tell that the port is taken
         return;
     }
 }
 
 void print_pdu_1(const PDU_1& pdu) {
     std::cout << "Identifier: " << pdu.identifier << std::endl;
+    std::cout << "Handle: " << pdu.handle << std::endl;
     std::cout << "i: " << pdu.i << std::endl;
     std::cout << "Value: " << pdu.value << std::endl;
     std::cout << "Period: " << pdu.period << std::endl;
@@ -126,6 +197,7 @@ void print_pdu_1(const PDU_1& pdu) {
 
 void print_pdu_2(const PDU_2& pdu) {
     std::cout << "Identifier: " << pdu.id << std::endl;
+    std::cout << "Request: " << pdu.req_id << std::endl;
     std::cout << "Type: " << pdu.type << std::endl;
     std::cout << "Active sources: " << pdu.active_sources << std::endl;
     std::cout << "Subscriber Id: " << pdu.sub.client_id << std::endl;
@@ -136,6 +208,14 @@ void print_pdu_2(const PDU_2& pdu) {
     unsigned short port = ntohs(pdu.sub.clientAddr.sin_port);
     std::cout << "Subscriber port: " << port << std::endl;
     std::cout << "Subscriber credits: " << pdu.sub.credits << std::endl;
+    std::cout << "Decimation: " << pdu.view.decimation << std::endl;
+    std::cout << "Window (ms): " << pdu.view.window_ms << std::endl;
+    std::cout << "Deadband: " << pdu.filter.deadband << std::endl;
+    std::cout << "Heartbeat (ms): " << pdu.filter.heartbeat_ms << std::endl;
+    if (pdu.aggregate.samples > 0) {
+        std::cout << "Window min/avg/max: " << pdu.aggregate.min << "/" << pdu.aggregate.avg << "/" << pdu.aggregate.max
+                  << " (" << pdu.aggregate.samples << " samples)" << std::endl;
+    }
     print_pdu_1(pdu.pdu);
 }
 
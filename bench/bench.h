@@ -0,0 +1,107 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+/* Microbenchmark harness shared by the bench_* programs.
+   Each program includes the SM (or source) code it measures and times every case for at least
+   --min-time seconds. It prints one JSON object per case, on its own line, so the output of two
+   commits can be diffed line by line. Allocations are counted by alloc.h.
+   Inputs come from a generator seeded with --seed (fixed by default), so every run measures the same work.
+
+   Build: g++ -std=c++17 -O2 -pthread bench/bench_fanout.cpp -o bench_fanout
+   Usage: bench_fanout [--seed N] [--min-time SECONDS] [--filter TEXT] > fanout.json */
+
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <random>
+#include <string>
+
+#include "../alloc.h"
+
+struct BenchOptions {
+    uint64_t seed = 20240611;  // semente dos geradores de entradas
+    double min_time = 0.5;     // segundos medidos por caso, no mínimo
+    std::string filter;        // só correr os casos cujo nome contém este texto
+};
+BenchOptions bench_options;
+bool bench_first_result = true;
+
+template <typename T>
+void bench_keep(const T& value) {  // Stops the compiler from dropping a result nobody reads
+    asm volatile("" : : "r,m"(value) : "memory");
+}
+
+std::mt19937_64 bench_random() {  // A generator every case starts from, so inputs don't depend on which cases ran
+    return std::mt19937_64(bench_options.seed);
+}
+
+std::string bench_identifier(uint64_t n) {  // Source or client identifier n, at most 9 characters
+    return "S" + std::to_string(n % 100000000);
+}
+
+bool bench_begin(const char* benchmark, int argc, char* argv[]) {  // Reads the options and opens the JSON document
+    for (int i = 1; i < argc; i++) {
+        std::string option(argv[i]);
+        if (i + 1 >= argc) {
+            std::cerr << "Usage: " << argv[0] << " [--seed N] [--min-time SECONDS] [--filter TEXT]" << std::endl;
+            return false;
+        }
+        std::string value(argv[++i]);
+        if (option == "--seed") {
+            bench_options.seed = std::strtoull(value.c_str(), nullptr, 10);
+        } else if (option == "--min-time") {
+            bench_options.min_time = std::atof(value.c_str());
+        } else if (option == "--filter") {
+            bench_options.filter = value;
+        } else {
+            std::cerr << "Unknown option: " << option << std::endl;
+            return false;
+        }
+    }
+    printf("{\"benchmark\": \"%s\", \"seed\": %llu, \"results\": [\n", benchmark, static_cast<unsigned long long>(bench_options.seed));
+    return true;
+}
+
+void bench_end() {
+    printf("\n]}\n");
+}
+
+template <typename Setup, typename Body>
+void run_benchmark(const std::string& name, uint64_t ops, Setup setup, Body body) {
+    /* Times body, which performs ops operations, until min_time has been spent in it. setup runs
+       untimed before every call (to rebuild what body consumes); allocations are only counted in body */
+    if (!bench_options.filter.empty() && name.find(bench_options.filter) == std::string::npos) {
+        return;
+    }
+    setup();
+    body();  // Warm-up: caches, and containers that grow to their steady state size
+    uint64_t runs = 0;
+    uint64_t elapsed_ns = 0;
+    uint64_t allocs = 0;
+    uint64_t bytes = 0;
+    uint64_t min_ns = static_cast<uint64_t>(bench_options.min_time * 1e9);
+    while (elapsed_ns < min_ns || runs == 0) {
+        setup();
+        uint64_t allocs_before = allocations.load(std::memory_order_relaxed);
+        uint64_t bytes_before = allocated_bytes.load(std::memory_order_relaxed);
+        auto start = std::chrono::steady_clock::now();
+        body();
+        auto end = std::chrono::steady_clock::now();
+        allocs += allocations.load(std::memory_order_relaxed) - allocs_before;
+        bytes += allocated_bytes.load(std::memory_order_relaxed) - bytes_before;
+        elapsed_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count();
+        runs++;
+    }
+    double total = static_cast<double>(runs * ops);
+    printf("%s  {\"name\": \"%s\", \"ns_per_op\": %.2f, \"allocs_per_op\": %.3f, \"bytes_per_op\": %.1f}",
+           bench_first_result ? "" : ",\n", name.c_str(), elapsed_ns / total, allocs / total, bytes / total);
+    fflush(stdout);
+    bench_first_result = false;
+}
+
+template <typename Body>
+void run_benchmark(const std::string& name, uint64_t ops, Body body) {
+    run_benchmark(name, ops, [] {}, body);
+}
+
+#endif
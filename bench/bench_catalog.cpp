@@ -0,0 +1,53 @@
+#define SM_NO_MAIN
+#include "../sm.cpp"
+#include "sm_fixture.h"
+
+/* Listing the active sources for clients, at several catalog sizes: get_sources_list (the list
+   answer of older clients), a catalog page from a random cursor, and the changes since a version. */
+
+int main(int argc, char* argv[]) {
+    if (!bench_begin("catalog", argc, argv)) {
+        return 1;
+    }
+    for (uint32_t n_sources : {16, 1024, 65536}) {
+        std::string suffix = "/sources=" + std::to_string(n_sources);
+        reset_sm();
+        std::vector<std::string> identifiers;
+        for (uint32_t s = 0; s < n_sources; s++) {
+            identifiers.push_back(bench_identifier(s));
+            add_active_source(identifiers.back());
+        }
+        PDU_2 pdu_2 = {};
+        run_benchmark("get_sources_list" + suffix, 1, [&] {
+            get_sources_list(pdu_2);
+            bench_keep(pdu_2);
+        });
+
+        std::mt19937_64 random = bench_random();
+        const int pages = 256;
+        std::vector<PDU_4> requests(pages);
+        for (PDU_4& request : requests) {
+            request = {};
+            const std::string& cursor = identifiers[random() % n_sources];
+            memcpy(request.cursor, cursor.c_str(), cursor.length());
+        }
+        PDU_4 pdu_4;
+        run_benchmark("get_catalog_page" + suffix, pages, [&] {
+            for (const PDU_4& request : requests) {
+                pdu_4 = request;
+                get_catalog_page(pdu_4);
+                bench_keep(pdu_4);
+            }
+        });
+        run_benchmark("get_catalog_changes" + suffix, pages, [&] {
+            for (int k = 0; k < pages; k++) {
+                pdu_4 = {};
+                pdu_4.version = catalog_version > CATALOG_PAGE_SIZE ? catalog_version - CATALOG_PAGE_SIZE : 0;
+                get_catalog_changes(pdu_4);
+                bench_keep(pdu_4);
+            }
+        });
+    }
+    bench_end();
+    return 0;
+}
@@ -0,0 +1,70 @@
+#define SM_NO_MAIN
+#include "../sm.cpp"
+#include "sm_fixture.h"
+
+/* The periodic scans of cleanup_thread: expire_sources over the source registry (all alive, or
+   with 1% gone quiet) and remove_finished_subscriptions over the subscriptions, none of them spent.
+   One op is one scan. */
+
+int main(int argc, char* argv[]) {
+    if (!bench_begin("cleanup", argc, argv)) {
+        return 1;
+    }
+    for (uint32_t n_sources : {16, 1024, 65536}) {
+        std::string suffix = "/sources=" + std::to_string(n_sources);
+        reset_sm();
+        std::vector<uint32_t> handles;
+        for (uint32_t s = 0; s < n_sources; s++) {
+            handles.push_back(add_active_source(bench_identifier(s)));
+        }
+        auto sampled = source_slots[0].pdu.timestamp;
+        for (SourceSlot& slot : source_slots) {
+            slot.pdu.timestamp = sampled;  // Scans at this time find every source alive
+        }
+        run_benchmark("expire_sources/alive" + suffix, 1, [&] {
+            std::lock_guard<std::mutex> lock(sources_mutex);
+            expire_sources(sampled);
+        });
+
+        std::mt19937_64 random = bench_random();
+        std::vector<uint32_t> quiet;
+        for (uint32_t k = 0; k < std::max<uint32_t>(1, n_sources / 100); k++) {
+            quiet.push_back(handles[random() % n_sources]);
+        }
+        run_benchmark("expire_sources/quiet=1%" + suffix, 1, [&] {  // Brings back the sources the scan expired
+            std::lock_guard<std::mutex> lock(sources_mutex);
+            for (uint32_t handle : handles) {
+                SourceSlot& slot = source_slots[handle - 1];
+                if (!slot.active) {
+                    slot.active = true;
+                    n_active_sources++;
+                    catalog_update(slot.pdu.identifier, false);
+                }
+                slot.pdu.timestamp = sampled;
+            }
+            for (uint32_t handle : quiet) {
+                source_slots[handle - 1].pdu.timestamp = sampled - std::chrono::seconds(1);
+            }
+        }, [&] {
+            std::lock_guard<std::mutex> lock(sources_mutex);
+            expire_sources(sampled);
+        });
+    }
+    for (uint32_t n_subscriptions : {16, 1024, 65536}) {
+        reset_sm();
+        uint32_t n_sources = std::max<uint32_t>(1, n_subscriptions / 64);
+        std::vector<uint32_t> sources;
+        for (uint32_t s = 0; s < n_sources; s++) {
+            sources.push_back(add_active_source(bench_identifier(s)));
+        }
+        for (uint32_t k = 0; k < n_subscriptions; k++) {  // 64 clients, each on every source
+            add_subscriber(k % 64, sources[k / 64 % n_sources], 100, View{});
+        }
+        run_benchmark("remove_finished_subscriptions/subscriptions=" + std::to_string(n_subscriptions), 1, [&] {
+            std::lock_guard<std::mutex> lock(client_mutex);
+            remove_finished_subscriptions();
+        });
+    }
+    bench_end();
+    return 0;
+}
@@ -0,0 +1,94 @@
+#define SM_NO_MAIN
+#include "../sm.cpp"
+#include "sm_fixture.h"
+
+/* Encoding and decoding of the PDUs. On the wire a PDU is its struct, so decoding is copying a
+   datagram into the struct and checking it (valid_sample, decode_request), and encoding is filling
+   the struct the SM sends: a data PDU_2 for a subscriber (view_sample and fill_subscriber, as the
+   fan-out does) and a catalog page PDU_4. */
+
+int main(int argc, char* argv[]) {
+    if (!bench_begin("codec", argc, argv)) {
+        return 1;
+    }
+    const int ops = 1024;
+    std::mt19937_64 random = bench_random();
+    std::vector<PDU_1> samples(ops);
+    for (PDU_1& sample : samples) {
+        sample = bench_sample(bench_identifier(random() % 1024), random() % 61);
+        sample.handle = random() % 1024 + 1;
+    }
+    run_benchmark("PDU_1/encode", ops, [&] {
+        char datagram[sizeof(PDU_1)];
+        for (const PDU_1& sample : samples) {
+            memcpy(datagram, &sample, sizeof(sample));
+            bench_keep(datagram);
+        }
+    });
+    run_benchmark("PDU_1/decode", ops, [&] {
+        PDU_1 pdu;
+        for (const PDU_1& sample : samples) {
+            memcpy(&pdu, &sample, sizeof(pdu));
+            bench_keep(valid_sample(pdu, sizeof(pdu)));
+        }
+    });
+
+    struct sockaddr_in clientAddr = {};
+    clientAddr.sin_family = AF_INET;
+    clientAddr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    std::vector<std::vector<char>> plays(ops, std::vector<char>(sizeof(PDU_2)));
+    for (std::vector<char>& datagram : plays) {
+        PDU_2 play = {};
+        play.id = 3;
+        play.req_id = random();
+        play.sub.credits = 100;
+        memcpy(play.sub.source_id, "S1", 3);
+        memcpy(datagram.data(), &play, sizeof(play));
+    }
+    std::vector<std::vector<char>> pages(ops, std::vector<char>(sizeof(PDU_4)));
+    for (std::vector<char>& datagram : pages) {
+        PDU_4 page = {};
+        page.id = 7;
+        page.req_id = random();
+        memcpy(datagram.data(), &page, sizeof(page));
+    }
+    Request request;
+    run_benchmark("PDU_2/decode", ops, [&] {
+        for (const std::vector<char>& datagram : plays) {
+            bench_keep(decode_request(datagram.data(), datagram.size(), clientAddr, request));
+        }
+    });
+    run_benchmark("PDU_4/decode", ops, [&] {
+        for (const std::vector<char>& datagram : pages) {
+            bench_keep(decode_request(datagram.data(), datagram.size(), clientAddr, request));
+        }
+    });
+
+    reset_sm();
+    uint32_t source = add_active_source("S1");
+    uint32_t handle = add_subscriber(0, source, 100, View{});
+    SourceView& view = source_views[source - 1][subscriptions[handle].view];
+    PDU_2 data = {};
+    memcpy(data.type, "data", 5);
+    run_benchmark("PDU_2/encode", ops, [&] {
+        std::lock_guard<std::mutex> lock(client_mutex);
+        for (const PDU_1& sample : samples) {
+            view_sample(view, sample, data);
+            fill_subscriber(data.sub, subscriptions[handle]);
+            data.filter = subscriptions[handle].filter;
+            bench_keep(data);
+        }
+    });
+
+    for (uint32_t s = 1; s < 1024; s++) {
+        add_active_source(bench_identifier(s));
+    }
+    PDU_4 page;
+    run_benchmark("PDU_4/encode", 1, [&] {
+        page = {};
+        get_catalog_page(page);
+        bench_keep(page);
+    });
+    bench_end();
+    return 0;
+}
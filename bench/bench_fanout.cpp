@@ -0,0 +1,68 @@
+#define SM_NO_MAIN
+#include "../sm.cpp"
+#include "sm_fixture.h"
+
+/* The fan-out pass of send_pdu (fan_out): every source with a sample waiting runs its views and
+   queues a PDU for each subscriber, from a few subscribers of one source to many sources per client.
+   The egress queues are emptied between passes, as the egress threads would, and credits never run
+   out, so every pass does the same work. One op is one pass. */
+
+const int ENDLESS_CREDITS = 1 << 30;
+
+void fanout_case(const std::string& name, uint32_t n_sources, uint32_t n_subscribers, const View& view, const Filter& filter,
+                 size_t backlog) {
+    // n_subscribers clients each subscribe to all n_sources; backlog samples arrive per source between passes
+    egress_config.queue_depth = std::max<size_t>(8, n_sources * std::max<size_t>(backlog, 1));  // No drops: only fan-out is measured
+    reset_sm(n_subscribers);  // The egress pool is sized with the queue depth
+    std::vector<uint32_t> sources;
+    for (uint32_t s = 0; s < n_sources; s++) {
+        sources.push_back(add_active_source(bench_identifier(s)));
+    }
+    for (uint32_t c = 0; c < n_subscribers; c++) {
+        for (uint32_t source : sources) {
+            add_subscriber(c, source, ENDLESS_CREDITS, view, filter);
+        }
+    }
+    std::mt19937_64 random = bench_random();
+    std::vector<uint32_t> fanout_sources;
+    auto setup = [&] {  // What ingest_batch leaves behind: new samples, marked pending
+        drain_egress();
+        fanout_sources = sources;
+        for (uint32_t source : sources) {
+            SourceSlot& slot = source_slots[source - 1];
+            slot.pending = true;
+            slot.pdu.value = random() % 61;
+            slot.pdu.timestamp += std::chrono::milliseconds(1);
+            slot.backlog.clear();
+            for (size_t k = 0; k < backlog; k++) {
+                slot.pdu.timestamp += std::chrono::milliseconds(1);
+                slot.backlog.push_back(slot.pdu);
+            }
+            slot.keep_backlog = backlog > 0;
+        }
+    };
+    run_benchmark(name, 1, setup, [&] {
+        std::lock_guard<std::mutex> lock(sources_mutex);
+        std::lock_guard<std::mutex> sub_lock(client_mutex);
+        bench_keep(fan_out(fanout_sources, std::chrono::steady_clock::now()));
+    });
+}
+
+int main(int argc, char* argv[]) {
+    if (!bench_begin("fanout", argc, argv)) {
+        return 1;
+    }
+    View plain = {};
+    Filter always = {};
+    for (uint32_t n : {1, 16, 256, 4096}) {
+        fanout_case("fan_out/sources=1/subscribers=" + std::to_string(n), 1, n, plain, always, 0);
+    }
+    for (uint32_t n : {1, 16}) {
+        fanout_case("fan_out/sources=256/subscribers=" + std::to_string(n), 256, n, plain, always, 0);
+    }
+    fanout_case("fan_out/sources=1/subscribers=256/deadband=10", 1, 256, plain, {10, 0}, 0);
+    fanout_case("fan_out/sources=1/subscribers=256/decimation=10/backlog=100", 1, 256, {10, 0}, always, 100);
+    fanout_case("fan_out/sources=1/subscribers=256/window=50ms/backlog=100", 1, 256, {0, 50}, always, 100);
+    bench_end();
+    return 0;
+}
@@ -0,0 +1,93 @@
+#define SM_NO_MAIN
+#include "../sm.cpp"
+#include "sm_fixture.h"
+
+/* The source registry at several cardinalities: interning new identifiers (source_handles insert),
+   finding known and unknown ones (control requests), ingest_batch storing a batch of samples
+   from registered sources (the data path, which goes by handle), and the subscriber churn of
+   play and stop requests (a new client subscribing to a source, then leaving). */
+
+void registry_cases(uint32_t n_sources) {
+    std::string suffix = "/sources=" + std::to_string(n_sources);
+    std::vector<std::string> identifiers;
+    for (uint32_t s = 0; s < n_sources; s++) {
+        identifiers.push_back(bench_identifier(s));
+    }
+
+    reset_sm();
+    run_benchmark("intern_source" + suffix, n_sources, [&] {
+        source_handles.clear();
+        source_slots.clear();
+    }, [&] {
+        std::lock_guard<std::mutex> lock(sources_mutex);
+        for (const std::string& identifier : identifiers) {
+            bench_keep(intern_source(identifier.c_str()));
+        }
+    });
+
+    reset_sm();
+    for (const std::string& identifier : identifiers) {
+        add_active_source(identifier);
+    }
+    const int lookups = 1024;
+    std::mt19937_64 random = bench_random();
+    std::vector<std::string> known, unknown;
+    for (int k = 0; k < lookups; k++) {
+        known.push_back(identifiers[random() % n_sources]);
+        unknown.push_back("U" + std::to_string(random() % 100000000));
+    }
+    run_benchmark("find_source/hit" + suffix, lookups, [&] {
+        std::lock_guard<std::mutex> lock(sources_mutex);
+        for (const std::string& identifier : known) {
+            bench_keep(find_source(identifier.c_str()));
+        }
+    });
+    run_benchmark("find_source/miss" + suffix, lookups, [&] {
+        std::lock_guard<std::mutex> lock(sources_mutex);
+        for (const std::string& identifier : unknown) {
+            bench_keep(find_source(identifier.c_str()));
+        }
+    });
+
+    PDU_1 batch[IO_BATCH];
+    PDU_1 samples[IO_BATCH];
+    struct sockaddr_in addrs[IO_BATCH] = {};
+    for (int k = 0; k < IO_BATCH; k++) {
+        uint32_t handle = random() % n_sources + 1;
+        samples[k] = source_slots[handle - 1].pdu;
+        samples[k].value = random() % 61;
+    }
+    run_benchmark("ingest_batch" + suffix, IO_BATCH, [&] {
+        for (uint32_t handle : dirty_sources) {  // What the fan-out does with the samples
+            source_slots[handle - 1].pending = false;
+        }
+        dirty_sources.clear();
+        memcpy(batch, samples, sizeof(batch));
+    }, [&] {
+        ingest_batch(batch, addrs, IO_BATCH, -1);
+    });
+
+    const int churn = 256;
+    std::vector<uint32_t> played;
+    for (int k = 0; k < churn; k++) {
+        played.push_back(random() % n_sources + 1);
+    }
+    run_benchmark("play_stop" + suffix, churn, [&] {
+        for (int k = 0; k < churn; k++) {
+            int32_t handle = add_subscriber(k, played[k], 100, View{});
+            std::lock_guard<std::mutex> lock(client_mutex);
+            remove_subscription(handle);  // Its client goes with it
+        }
+    });
+}
+
+int main(int argc, char* argv[]) {
+    if (!bench_begin("registry", argc, argv)) {
+        return 1;
+    }
+    for (uint32_t n : {16, 1024, 65536}) {
+        registry_cases(n);
+    }
+    bench_end();
+    return 0;
+}
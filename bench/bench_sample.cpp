@@ -0,0 +1,34 @@
+#define SOURCE_NO_MAIN
+#include "../source.cpp"
+#include "bench.h"
+
+/* Sample generation on the source side: generate_sample alone, and generate_pdu, which also
+   stamps the clock, for the sizes of the shipped configurations (F x N samples per period). */
+
+int main(int argc, char* argv[]) {
+    if (!bench_begin("sample", argc, argv)) {
+        return 1;
+    }
+    const int ops = 4096;
+    for (int N : {10, 100, 1000}) {
+        std::mt19937_64 random = bench_random();
+        std::vector<int> indexes(ops);
+        for (int& i : indexes) {
+            i = random() % N;
+        }
+        run_benchmark("generate_sample/N=" + std::to_string(N), ops, [&] {
+            for (int i : indexes) {
+                bench_keep(generate_sample(i, N));
+            }
+        });
+        char identifier[] = "source";
+        run_benchmark("generate_pdu/N=" + std::to_string(N), ops, [&] {
+            for (int i : indexes) {
+                PDU_1 pdu = generate_pdu(identifier, i, 1, 10, N, 5);
+                bench_keep(pdu);
+            }
+        });
+    }
+    bench_end();
+    return 0;
+}
@@ -0,0 +1,147 @@
+#include "../api.h"
+
+/* End-to-end load generator for the SM.
+   Feeds S sources at a fixed total sample rate, subscribes C clients to every source
+   (refilling their credits as they go) and reports, over the measured window, the ingest
+   and delivery rates plus the CPU the SM process spent per delivered sample.
+
+   Usage: loadgen SOURCES CLIENTS RATE SECONDS SM_PID [SM_IP] [INGEST_PORT] [CONTROL_PORT] */
+
+std::atomic<bool> keep_running(true);
+std::atomic<uint64_t> samples_sent(0);
+std::atomic<uint64_t> samples_received(0);
+
+void feed_sources(const std::string ip, int port, int n_sources, double rate) {
+    int sockfd;
+    struct sockaddr_in server;
+    create_sender_socket(ip, port, sockfd, server);
+
+    std::vector<uint32_t> handles(n_sources, 0);
+    std::vector<std::string> ids(n_sources);
+    for (int s = 0; s < n_sources; s++) {
+        ids[s] = "L" + std::to_string(s);
+    }
+    auto start = std::chrono::steady_clock::now();
+    uint64_t n = 0;
+    while (keep_running.load()) {
+        for (int s = 0; s < n_sources; s++) {
+            PDU_1 pdu = {};
+            memcpy(pdu.identifier, ids[s].c_str(), ids[s].length());
+            pdu.handle = handles[s];
+            pdu.i = n;
+            pdu.value = n % 60;
+            pdu.period = 1;
+            pdu.frequency = 1000;
+            pdu.multiple = 1000;
+            pdu.timestamp = std::chrono::system_clock::now();
+            sendto(sockfd, &pdu, sizeof(pdu), 0, (struct sockaddr*)&server, sizeof(server));
+            n++;
+            samples_sent++;
+
+            PDU_1 reply;
+            while (recv(sockfd, &reply, sizeof(reply), MSG_DONTWAIT) == sizeof(reply)) {  // Registration replies
+                for (int k = 0; k < n_sources; k++) {
+                    if (ids[k] == reply.identifier) {
+                        handles[k] = reply.handle;
+                    }
+                }
+            }
+        }
+        std::this_thread::sleep_until(start + std::chrono::nanoseconds(static_cast<uint64_t>(n * 1e9 / rate)));
+    }
+    close(sockfd);
+}
+
+void run_client(const std::string ip, int port, int client, int n_sources) {
+    int sockfd;
+    struct sockaddr_in server;
+    create_sender_socket(ip, port, sockfd, server);
+    int buffer_size = 4 << 20;
+    setsockopt(sockfd, SOL_SOCKET, SO_RCVBUF, &buffer_size, sizeof(buffer_size));
+    struct timeval timeout = {0, 100000};
+    setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    std::string client_id = "c" + std::to_string(client);
+    auto play = [&](const char* source_id) {
+        PDU_2 pdu_2 = {};
+        pdu_2.id = 3;
+        pdu_2.req_id = 1;
+        memcpy(pdu_2.type, "play", 5);
+        memcpy(pdu_2.sub.client_id, client_id.c_str(), client_id.length());
+        memcpy(pdu_2.sub.source_id, source_id, strnlen(source_id, sizeof(pdu_2.sub.source_id) - 1));
+        sendto(sockfd, &pdu_2, sizeof(pdu_2), 0, (struct sockaddr*)&server, sizeof(server));
+    };
+    for (int s = 0; s < n_sources; s++) {
+        play(("L" + std::to_string(s)).c_str());
+    }
+
+    PDU_2 pdu_2;
+    while (keep_running.load()) {
+        if (recv(sockfd, &pdu_2, sizeof(pdu_2), 0) != sizeof(pdu_2) || pdu_2.id != 0) {
+            continue;
+        }
+        samples_received++;
+        if (pdu_2.sub.credits < 50 && pdu_2.sub.credits % 10 == 9) {  // Refill well before running out
+            play(pdu_2.sub.source_id);
+        }
+    }
+    close(sockfd);
+}
+
+double process_cpu_ms(int pid) {  // utime + stime of the process, in milliseconds
+    std::ifstream stat_file("/proc/" + std::to_string(pid) + "/stat");
+    std::string field;
+    for (int i = 0; i < 13; i++) {
+        stat_file >> field;
+    }
+    long utime = 0, stime = 0;
+    stat_file >> utime >> stime;
+    return (utime + stime) * 1000.0 / sysconf(_SC_CLK_TCK);
+}
+
+int main(int argc, char* argv[]) {
+    if (argc < 6) {
+        std::cerr << "Usage: " << argv[0] << " SOURCES CLIENTS RATE SECONDS SM_PID [SM_IP] [INGEST_PORT] [CONTROL_PORT]" << std::endl;
+        return 1;
+    }
+    int n_sources = std::stoi(argv[1]);
+    int n_clients = std::stoi(argv[2]);
+    double rate = std::stod(argv[3]);
+    int seconds = std::stoi(argv[4]);
+    int sm_pid = std::stoi(argv[5]);
+    std::string ip = argc > 6 ? argv[6] : "127.0.0.1";
+    int ingest_port = argc > 7 ? std::stoi(argv[7]) : 12345;
+    int control_port = argc > 8 ? std::stoi(argv[8]) : 12347;
+
+    std::thread source_thread(feed_sources, ip, ingest_port, n_sources, rate);
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));  // Let the sources register first
+    std::vector<std::thread> client_threads;
+    for (int c = 0; c < n_clients; c++) {
+        client_threads.emplace_back(run_client, ip, control_port, c, n_sources);
+    }
+    std::this_thread::sleep_for(std::chrono::seconds(1));  // Warm up
+
+    double cpu_start = process_cpu_ms(sm_pid);
+    uint64_t sent_start = samples_sent.load();
+    uint64_t received_start = samples_received.load();
+    auto start = std::chrono::steady_clock::now();
+    std::this_thread::sleep_for(std::chrono::seconds(seconds));
+    double cpu_end = process_cpu_ms(sm_pid);
+    uint64_t sent_end = samples_sent.load();
+    uint64_t received_end = samples_received.load();
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    keep_running.store(false);
+    source_thread.join();
+    for (auto& client_thread : client_threads) {
+        client_thread.join();
+    }
+
+    double ingest = (sent_end - sent_start) / elapsed;
+    double delivered = (received_end - received_start) / elapsed;
+    double cpu = (cpu_end - cpu_start) / elapsed;
+    std::cout << "ingest " << static_cast<long>(ingest) << "/s, delivered " << static_cast<long>(delivered) << "/s (expected "
+              << static_cast<long>(ingest * n_clients) << "/s), SM cpu " << static_cast<long>(cpu) << " ms/s, "
+              << (delivered > 0 ? cpu * 1000 / delivered : 0) << " us per delivered sample" << std::endl;
+    return 0;
+}
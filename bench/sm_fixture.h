@@ -0,0 +1,76 @@
+#ifndef SM_FIXTURE_H
+#define SM_FIXTURE_H
+
+/* SM state for the benchmarks that include sm.cpp: builds source registries and subscriber sets
+   directly, the way the ingest and control paths would, without sockets or threads. */
+
+#include "bench.h"
+
+void reset_sm(size_t max_clients = 4096) {
+    /* Back to an SM with no sources, clients or catalog, and a single egress lane. Room for every
+       case's sources and subscriptions; the egress pool holds 2 * max_clients queues of queue_depth */
+    egress_lanes.clear();
+    egress_lanes.emplace_back(new EgressLane());
+    capacity_config.max_sources = 65536;
+    capacity_config.max_clients = max_clients;
+    capacity_config.max_subscriptions = 65536;
+    init_capacity();
+}
+
+PDU_1 bench_sample(const std::string& identifier, int value) {  // A sample stamped now, as a source sends it
+    PDU_1 pdu = {};
+    memcpy(pdu.identifier, identifier.c_str(), std::min(identifier.length(), sizeof(pdu.identifier) - 1));
+    pdu.value = value;
+    pdu.period = 1;
+    pdu.frequency = 10;
+    pdu.multiple = 100;
+    pdu.max_period = 5;
+    pdu.timestamp = std::chrono::system_clock::now();
+    return pdu;
+}
+
+uint32_t add_active_source(const std::string& identifier) {  // Registers a source that just sent a sample
+    std::lock_guard<std::mutex> lock(sources_mutex);
+    uint32_t handle = intern_source(identifier.c_str());
+    SourceSlot& slot = source_slots[handle - 1];
+    slot.pdu = bench_sample(identifier, 0);
+    slot.pdu.handle = handle;
+    slot.active = true;
+    n_active_sources++;
+    catalog_update(identifier.c_str(), false);
+    return handle;
+}
+
+int32_t add_subscriber(uint32_t n, uint32_t source, int credits, const View& view, const Filter& filter = {}) {
+    // Subscribes client n (one endpoint per n) to source, the way a play request does; -1 if there is no room
+    std::lock_guard<std::mutex> lock(client_mutex);
+    Subscriber sub = {};
+    std::string client_id = "C" + std::to_string(n);
+    memcpy(sub.client_id, client_id.c_str(), std::min(client_id.length(), sizeof(sub.client_id) - 1));
+    sub.clientAddr.sin_family = AF_INET;
+    sub.clientAddr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    sub.clientAddr.sin_port = htons(1024 + n % 60000);
+    int32_t client = find_client(sub);
+    if (client == -1 && (client = add_client(sub)) == -1) {
+        return -1;
+    }
+    int32_t handle = add_subscription(client, source, source_slots[source - 1].pdu.identifier, credits, view);
+    if (handle >= 0) {
+        subscriptions[handle].filter = filter;
+    }
+    return handle;
+}
+
+void drain_egress() {  // What the egress threads do after sending: empties every queue handed to them
+    for (auto& lane : egress_lanes) {
+        for (auto& queue : lane->ready) {
+            queue->head = 0;
+            queue->count = 0;
+            queue->scheduled = false;
+        }
+        lane->ready.clear();
+        lane->woken.store(false);
+    }
+}
+
+#endif
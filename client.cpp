@@ -5,6 +5,29 @@ std::condition_variable cv;
 
 std::atomic_bool confirmation_showing(false);
 
+struct Dispatcher {
+    int sockfd;                           // socket partilhado por pedidos, respostas e dados
+    struct sockaddr_in serverAddr;        // endereço do SM
+    char *client_id;                      // identificador do cliente
+    std::atomic<uint32_t> next_req_id;    // próximo identificador de pedido
+    std::atomic_bool running;             // controla a thread de despacho
+    std::mutex mutex;                     // protege as respostas e a fila de dados
+    std::condition_variable reply_cv;     // sinaliza a chegada de respostas
+    std::condition_variable data_cv;      // sinaliza a chegada de dados
+    std::unordered_map<uint32_t, bool> pending;    // pedidos à espera de resposta
+    std::unordered_map<uint32_t, PDU_2> replies;   // respostas ainda não recolhidas
+    std::unordered_map<uint32_t, PDU_4> pages;     // páginas do catálogo ainda não recolhidas
+    std::deque<PDU_2> data_queue;                  // amostras ainda não mostradas
+};
+
+struct Catalog {
+    bool loaded = false;            // já foi feita uma listagem completa
+    uint64_t version = 0;           // versão do catálogo a que corresponde a cópia local
+    std::set<std::string> sources;  // fontes ativas
+};
+
+const size_t MAX_QUEUED_DATA = 256;  // Oldest samples are dropped past this point
+
 void populate_pdu(PDU_2 &pdu, int id, std::string type, char *client_id, const std::string source_id = "\0", const std::string source_info_id = "\0") {
     size_t length;
     size_t max_size;
@@ -54,7 +77,8 @@ void display_menu() {
     std::cout << "2. Get more info on sources" << std::endl;
     std::cout << "3. Play from a source" << std::endl;
     std::cout << "4. Stop playing from a source" << std::endl;
-    std::cout << "5. Quit" << std::endl;
+    std::cout << "5. Replay a recorded source" << std::endl;
+    std::cout << "6. Quit" << std::endl;
     std::cout << "------------------------------------" << std::endl;
     std::cout << "Enter your choice: ";
 }
@@ -81,13 +105,13 @@ void display_info(PDU_1 pdu_1) {
     }
 }
 
-void display_sources(PDU_2 pdu_2) {
+void display_sources(const std::set<std::string> &sources) {
     std::cout << "------------------------------------" << std::endl;
     std::cout << "            LIST SOURCES            " << std::endl;
     std::cout << "------------------------------------" << std::endl;
     std::cout << "Sources: ";
-    for (size_t i = 0; i < strlen(pdu_2.active_sources); i++) {
-        std::cout << pdu_2.active_sources[i] << " ";
+    for (const auto &source : sources) {
+        std::cout << source << " ";
     }
     std::cout << std::endl;
     std::cout << "------------------------------------" << std::endl;
@@ -102,20 +126,13 @@ void display_sources(PDU_2 pdu_2) {
     }
 }
 
-void display_chooser(std::string &input, PDU_2 pdu_2) {
+void display_chooser(std::string &input, const std::set<std::string> &sources, bool subscribed = false) {
     std::cout << "------------------------------------" << std::endl;
     std::cout << "           CHOOSE SOURCE            " << std::endl;
     std::cout << "------------------------------------" << std::endl;
-    if (pdu_2.id != 6) {
-        std::cout << "Available Sources: ";
-        for (size_t i = 0; i < strlen(pdu_2.active_sources); i++) {
-            std::cout << pdu_2.active_sources[i] << " ";
-        }
-    } else {
-        std::cout << "Subscribed Sources: ";
-        for (size_t i = 0; i < strlen(pdu_2.sub.source_id); i++) {
-            std::cout << pdu_2.sub.source_id[i] << " ";
-        }
+    std::cout << (subscribed ? "Subscribed Sources: " : "Available Sources: ");
+    for (const auto &source : sources) {
+        std::cout << source << " ";
     }
     std::cout << std::endl;
     std::cout << "Enter source identifier: ";
@@ -125,6 +142,71 @@ void display_chooser(std::string &input, PDU_2 pdu_2) {
     std::cout.flush();
 }
 
+void display_view_chooser(View &view) {
+    char mode;
+    view = {};
+    std::cout << "View: (a)ll samples, (d)ecimated, (w)indowed min/avg/max: ";
+    std::cin >> mode;
+    if (mode == 'd') {
+        std::cout << "Deliver one sample out of: ";
+        std::cin >> view.decimation;
+    } else if (mode == 'w') {
+        std::cout << "Window (ms): ";
+        std::cin >> view.window_ms;
+    }
+    if (std::cin.fail()) {
+        view = {};
+    }
+    std::cin.clear();
+    std::cout << "------------------------------------" << std::endl;
+    std::cout.flush();
+}
+
+void display_filter_chooser(Filter &filter) {
+    char mode;
+    filter = {};
+    std::cout << "Deliver: (a)ll samples, (c)hanges only, changes of at least a (d)eadband: ";
+    std::cin >> mode;
+    if (mode == 'c') {
+        filter.deadband = 1;
+    } else if (mode == 'd') {
+        std::cout << "Deadband: ";
+        std::cin >> filter.deadband;
+    }
+    if (filter.deadband > 0) {
+        std::cout << "Heartbeat every (ms, 0 for none): ";
+        std::cin >> filter.heartbeat_ms;
+    }
+    if (std::cin.fail()) {
+        filter = {};
+    }
+    std::cin.clear();
+    std::cout << "------------------------------------" << std::endl;
+    std::cout.flush();
+}
+
+void display_replay_chooser(Replay &replay) {
+    int64_t seconds_ago = 0;
+    int64_t duration = 0;
+    replay = {};
+    std::cout << "Start how many seconds ago: ";
+    std::cin >> seconds_ago;
+    std::cout << "Duration (s): ";
+    std::cin >> duration;
+    std::cout << "Speed (times real time, 0 for as fast as possible): ";
+    std::cin >> replay.speed;
+    if (std::cin.fail()) {
+        replay = {};
+    } else {
+        replay.from_ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count() -
+                         seconds_ago * 1000;
+        replay.to_ms = replay.from_ms + duration * 1000;
+    }
+    std::cin.clear();
+    std::cout << "------------------------------------" << std::endl;
+    std::cout.flush();
+}
+
 void display_confirmation() {
     std::cout << "------------------------------------" << std::endl;
     std::cout << "      ARE YOU STILL WATCHING?       " << std::endl;
@@ -136,42 +218,228 @@ void display_confirmation() {
     std::cout.flush();
 }
 
-void recv_pdu(char *client_id, int type, int sockfd, PDU_2 &pdu_2, std::atomic_bool &exit) {
+void dispatch_loop(Dispatcher &dispatcher) {
+    /* Only reader of the socket: routes replies to the request waiting for their req_id
+       and data to the data queue, so neither can consume the other */
     sockaddr_in clientAddr = {};
-    socklen_t clientAddrLen = sizeof(clientAddr);
+    socklen_t clientAddrLen;
+    char buffer[std::max(sizeof(PDU_2), sizeof(PDU_4))];
+    PDU_2 pdu_2;
+    PDU_4 pdu_4;
 
-    fd_set read_set;
-    FD_ZERO(&read_set);
-    FD_SET(sockfd, &read_set);
+    while (dispatcher.running.load()) {
+        fd_set read_set;
+        FD_ZERO(&read_set);
+        FD_SET(dispatcher.sockfd, &read_set);
 
-    struct timeval timeout;
-    timeout.tv_sec = 5;  // Timeout value in seconds
-    timeout.tv_usec = 0;
+        struct timeval timeout;
+        timeout.tv_sec = 0;
+        timeout.tv_usec = 100000;  // Wake up regularly to check if we should stop
 
-    while (true) {
-        int select_res = select(sockfd + 1, &read_set, nullptr, nullptr, &timeout);
+        int select_res = select(dispatcher.sockfd + 1, &read_set, nullptr, nullptr, &timeout);
         if (select_res == -1) {
             std::cerr << "Failed in socket select" << std::endl;
-            close(sockfd);
             break;
         } else if (select_res == 0) {
-            // std::cout << "Timeout occurred." << std::endl;
-            exit.store(true);
-            break;
+            continue;
         }
-        ssize_t recvd_bytes = recvfrom(sockfd, &pdu_2, sizeof(pdu_2), 0, (struct sockaddr *)&clientAddr, &clientAddrLen);
+        clientAddrLen = sizeof(clientAddr);
+        ssize_t recvd_bytes = recvfrom(dispatcher.sockfd, buffer, sizeof(buffer), 0, (struct sockaddr *)&clientAddr, &clientAddrLen);
         if (recvd_bytes == -1) {
             std::cerr << "Failed to receive response from server" << std::endl;
-            break;
+            continue;
         }
-        if (std::strcmp(pdu_2.sub.client_id, client_id) == 0 && pdu_2.id == type) {
-            break;
+        int id;
+        memcpy(&id, buffer, sizeof(id));
+        if (id == 6 || id == 7 || id == 8) {  // Subscription and catalog pages
+            if (static_cast<size_t>(recvd_bytes) < sizeof(PDU_4)) {
+                continue;
+            }
+            memcpy(&pdu_4, buffer, sizeof(pdu_4));
+            std::lock_guard<std::mutex> lock(dispatcher.mutex);
+            if (std::strcmp(pdu_4.client_id, dispatcher.client_id) == 0 && dispatcher.pending.count(pdu_4.req_id) > 0) {
+                dispatcher.pending.erase(pdu_4.req_id);
+                dispatcher.pages[pdu_4.req_id] = pdu_4;
+                dispatcher.reply_cv.notify_all();
+            }
+            continue;
+        }
+        if (static_cast<size_t>(recvd_bytes) < sizeof(PDU_2)) {
+            continue;
+        }
+        memcpy(&pdu_2, buffer, sizeof(pdu_2));
+        if (std::strcmp(pdu_2.sub.client_id, dispatcher.client_id) != 0) {
+            continue;
+        }
+        std::lock_guard<std::mutex> lock(dispatcher.mutex);
+        if (pdu_2.req_id == 0) {
+            if (dispatcher.data_queue.size() >= MAX_QUEUED_DATA) {
+                dispatcher.data_queue.pop_front();
+            }
+            dispatcher.data_queue.push_back(pdu_2);
+            dispatcher.data_cv.notify_one();
+        } else if (dispatcher.pending.count(pdu_2.req_id) > 0) {
+            dispatcher.pending.erase(pdu_2.req_id);
+            dispatcher.replies[pdu_2.req_id] = pdu_2;
+            dispatcher.reply_cv.notify_all();
+        }  // Replies nobody waits for (e.g. credit refills) are dropped
+    }
+    dispatcher.running.store(false);
+    dispatcher.reply_cv.notify_all();
+    dispatcher.data_cv.notify_all();
+}
+
+template <typename PDU>
+uint32_t send_request(Dispatcher &dispatcher, PDU &pdu, bool wait_reply = true) {
+    // Tags the request with a fresh req_id and sends it without waiting for the reply
+    uint32_t req_id = dispatcher.next_req_id.fetch_add(1);
+    if (req_id == 0) {
+        req_id = dispatcher.next_req_id.fetch_add(1);  // 0 is reserved for data
+    }
+    pdu.req_id = req_id;
+    if (wait_reply) {
+        std::lock_guard<std::mutex> lock(dispatcher.mutex);
+        dispatcher.pending[req_id] = true;
+    }
+    if (sendto(dispatcher.sockfd, &pdu, sizeof(pdu), 0, (struct sockaddr *)&dispatcher.serverAddr, sizeof(dispatcher.serverAddr)) == -1) {
+        std::cerr << "Failed to send request to server." << std::endl;
+        std::lock_guard<std::mutex> lock(dispatcher.mutex);
+        dispatcher.pending.erase(req_id);
+        return 0;
+    }
+    return req_id;
+}
+
+template <typename PDU>
+bool recv_reply(Dispatcher &dispatcher, uint32_t req_id, std::unordered_map<uint32_t, PDU> &replies, PDU &pdu) {
+    // Waits up to 5 seconds for the reply to req_id; other replies and data are left alone
+    std::unique_lock<std::mutex> lock(dispatcher.mutex);
+    bool arrived = dispatcher.reply_cv.wait_for(lock, std::chrono::seconds(5), [&] {
+        return replies.count(req_id) > 0 || !dispatcher.running.load();
+    });
+    auto reply = replies.find(req_id);
+    if (!arrived || reply == replies.end()) {
+        dispatcher.pending.erase(req_id);
+        pdu = {};
+        return false;
+    }
+    pdu = reply->second;
+    replies.erase(reply);
+    return true;
+}
+
+bool request(Dispatcher &dispatcher, PDU_2 &pdu_2) {
+    uint32_t req_id = send_request(dispatcher, pdu_2);
+    return req_id != 0 && recv_reply(dispatcher, req_id, dispatcher.replies, pdu_2);
+}
+
+bool request(Dispatcher &dispatcher, PDU_4 &pdu_4) {
+    uint32_t req_id = send_request(dispatcher, pdu_4);
+    return req_id != 0 && recv_reply(dispatcher, req_id, dispatcher.pages, pdu_4);
+}
+
+bool request(Dispatcher &dispatcher, PDU_2 &pdu_2, PDU_4 &pdu_4) {  // Requests answered with a page
+    uint32_t req_id = send_request(dispatcher, pdu_2);
+    return req_id != 0 && recv_reply(dispatcher, req_id, dispatcher.pages, pdu_4);
+}
+
+bool load_subscriptions(Dispatcher &dispatcher, std::set<std::string> &sources) {
+    // Pages through the sources this client is subscribed to
+    PDU_2 pdu_2;
+    PDU_4 pdu_4;
+    std::string cursor;
+    sources.clear();
+    do {
+        populate_pdu(pdu_2, 6, "subd", dispatcher.client_id, "\0", cursor);
+        if (!request(dispatcher, pdu_2, pdu_4)) {
+            return false;
+        }
+        for (uint16_t k = 0; k < pdu_4.count; k++) {
+            sources.insert(std::string(pdu_4.entries[k].identifier, strnlen(pdu_4.entries[k].identifier, sizeof(pdu_4.entries[k].identifier))));
+        }
+        cursor.assign(pdu_4.cursor, strnlen(pdu_4.cursor, sizeof(pdu_4.cursor)));
+    } while (pdu_4.more);
+    return true;
+}
+
+void populate_pdu(PDU_4 &pdu, int id, char *client_id, uint64_t version, const char *cursor) {
+    pdu = {};
+    pdu.id = id;
+    memcpy(pdu.client_id, client_id, std::min(strlen(client_id), sizeof(pdu.client_id) - 1));
+    memcpy(pdu.cursor, cursor, std::min(strlen(cursor), sizeof(pdu.cursor) - 1));
+    pdu.version = version;
+}
+
+bool load_catalog(Dispatcher &dispatcher, Catalog &catalog) {
+    // Pages through the whole catalog, one datagram at a time
+    PDU_4 pdu_4;
+    std::string cursor;
+    std::set<std::string> sources;
+    uint64_t version = 0;
+    bool first_page = true;
+    do {
+        populate_pdu(pdu_4, 7, dispatcher.client_id, 0, cursor.c_str());
+        if (!request(dispatcher, pdu_4)) {
+            return false;
         }
+        if (first_page) {
+            version = pdu_4.version;  // Later pages may be newer; the change feed covers the gap
+            first_page = false;
+        }
+        for (uint16_t k = 0; k < pdu_4.count; k++) {
+            sources.insert(std::string(pdu_4.entries[k].identifier, strnlen(pdu_4.entries[k].identifier, sizeof(pdu_4.entries[k].identifier))));
+        }
+        cursor.assign(pdu_4.cursor, strnlen(pdu_4.cursor, sizeof(pdu_4.cursor)));
+    } while (pdu_4.more);
+    catalog.sources = sources;
+    catalog.version = version;
+    catalog.loaded = true;
+    return true;
+}
+
+bool refresh_catalog(Dispatcher &dispatcher, Catalog &catalog) {
+    // Applies the changes made since our copy, relisting only when the server forgot them
+    if (!catalog.loaded && !load_catalog(dispatcher, catalog)) {
+        return false;
     }
+    PDU_4 pdu_4;
+    do {
+        populate_pdu(pdu_4, 8, dispatcher.client_id, catalog.version, "");
+        if (!request(dispatcher, pdu_4)) {
+            return false;
+        }
+        if (pdu_4.reset) {
+            catalog.loaded = false;
+            return load_catalog(dispatcher, catalog) && refresh_catalog(dispatcher, catalog);
+        }
+        for (uint16_t k = 0; k < pdu_4.count; k++) {
+            std::string identifier(pdu_4.entries[k].identifier, strnlen(pdu_4.entries[k].identifier, sizeof(pdu_4.entries[k].identifier)));
+            if (pdu_4.entries[k].removed) {
+                catalog.sources.erase(identifier);
+            } else {
+                catalog.sources.insert(identifier);
+            }
+        }
+        catalog.version = std::max(catalog.version, pdu_4.version);
+    } while (pdu_4.more);
+    return true;
 }
 
-void still_watching(int period, std::atomic_bool &exit, PDU_2 &pdu_2, char *client_id, std::string input, int sockfd, sockaddr_in serverAddr, ssize_t bytes_sent) {
+void recv_data(Dispatcher &dispatcher, PDU_2 &pdu_2, std::atomic_bool &exit, std::chrono::milliseconds timeout = std::chrono::seconds(5)) {
+    // Waits up to timeout for a data sample, signalling exit on timeout
+    std::unique_lock<std::mutex> lock(dispatcher.mutex);
+    if (!dispatcher.data_cv.wait_for(lock, timeout, [&] { return !dispatcher.data_queue.empty() || !dispatcher.running.load(); }) ||
+        dispatcher.data_queue.empty()) {
+        exit.store(true);
+        return;
+    }
+    pdu_2 = dispatcher.data_queue.front();
+    dispatcher.data_queue.pop_front();
+}
+
+void still_watching(int period, std::atomic_bool &exit, Dispatcher &dispatcher, std::string input) {
     auto last_time = std::chrono::steady_clock::now();
+    PDU_2 pdu_2;
     while (!exit) {
         if (std::chrono::steady_clock::now() - std::chrono::seconds(period) >= last_time) {
             last_time = std::chrono::steady_clock::now();
@@ -191,11 +459,8 @@ void still_watching(int period, std::atomic_bool &exit, PDU_2 &pdu_2, char *clie
                 system(CLEAR_COMMAND);
             }
             if (stop) {
-                populate_pdu(pdu_2, 4, "stop", client_id, "\0", input);
-                if ((bytes_sent = sendto(sockfd, &pdu_2, sizeof(pdu_2), 0, (struct sockaddr *)&serverAddr, sizeof(serverAddr))) == -1) {
-                    std::cerr << "Failed to send response to client." << std::endl;
-                }
-                // recv_pdu(client_id, 5, sockfd, pdu_2);
+                populate_pdu(pdu_2, 4, "stop", dispatcher.client_id, "\0", input);
+                send_request(dispatcher, pdu_2, false);
                 exit.store(true);
             }
             confirmation_showing.store(false);
@@ -210,16 +475,27 @@ void still_watching(int period, std::atomic_bool &exit, PDU_2 &pdu_2, char *clie
 }
 
 void display_sin_value(PDU_2 pdu_2) {
+    if (pdu_2.aggregate.samples > 0) {  // One line per window: the average, then the range
+        for (int i = 0; i < std::lround(pdu_2.aggregate.avg); i++) {
+            std::cout << "*";
+        }
+        std::cout << "  [" << pdu_2.aggregate.min << ".." << pdu_2.aggregate.max << "]" << std::endl;
+        return;
+    }
     for (int i = 0; i < pdu_2.pdu.value; i++) {
         std::cout << "*";
     }
     std::cout << std::endl;
 }
 
-void display_channel(PDU_2 &pdu_2, int sockfd, std::string input, char *client_id, std::atomic_bool &exit, sockaddr_in serverAddr, ssize_t bytes_sent) {
+void display_channel(Dispatcher &dispatcher, std::string input, View view, Filter filter, std::atomic_bool &exit) {
+    PDU_2 pdu_2;
+    bool refill_pending = false;
+    auto timeout = std::max<std::chrono::milliseconds>(
+        {std::chrono::seconds(5), std::chrono::milliseconds(2 * view.window_ms), std::chrono::milliseconds(2 * filter.heartbeat_ms)});
     while (!exit) {
         pdu_2 = {};
-        recv_pdu(client_id, 0, sockfd, pdu_2, exit);
+        recv_data(dispatcher, pdu_2, exit, timeout);
         if (std::strcmp(pdu_2.sub.source_id, input.c_str()) == 0) {
             {
                 std::unique_lock<std::mutex> lock(screen_mutex);
@@ -227,24 +503,51 @@ void display_channel(PDU_2 &pdu_2, int sockfd, std::string input, char *client_i
                 cv.wait(lock, [] { return !confirmation_showing; });
                 display_sin_value(pdu_2);
             }
-            if (pdu_2.sub.credits < 3) {
-                populate_pdu(pdu_2, 3, "play", client_id, input, "\0");
-                if ((bytes_sent = sendto(sockfd, &pdu_2, sizeof(pdu_2), 0, (struct sockaddr *)&serverAddr, sizeof(serverAddr))) == -1) {
-                    std::cerr << "Failed to send response to client." << std::endl;
-                }
-                recv_pdu(client_id, 5, sockfd, pdu_2, exit);
+            // Refill credits without waiting for the ack, so no samples are held back meanwhile
+            if (pdu_2.sub.credits < 3 && !refill_pending) {
+                populate_pdu(pdu_2, 3, "play", dispatcher.client_id, input, "\0");
+                pdu_2.view = view;  // A refill with another view would switch the subscription to it
+                pdu_2.filter = filter;
+                refill_pending = send_request(dispatcher, pdu_2, false) != 0;
+            } else if (pdu_2.sub.credits >= 3) {
+                refill_pending = false;
             }
         }
     }
 }
 
-void menu_handler(int port, int sockfd, struct sockaddr_in serverAddr, char *client_id) {
+void display_replay(Dispatcher &dispatcher, std::string input) {
+    // Shows the replayed samples until the SM says the range is over (or q is pressed)
+    PDU_2 pdu_2;
+    std::atomic_bool exit(false);
+    while (!exit) {
+        pdu_2 = {};
+        recv_data(dispatcher, pdu_2, exit);
+        if (exit || std::strcmp(pdu_2.sub.source_id, input.c_str()) != 0) {
+            continue;
+        }
+        if (std::strcmp(pdu_2.type, "done") == 0) {
+            break;
+        }
+        if (std::strcmp(pdu_2.type, "rply") == 0) {
+            display_sin_value(pdu_2);
+        }
+        if (is_key_pressed() && get_char() == 'q') {
+            break;
+        }
+    }
+}
+
+void menu_handler(Dispatcher &dispatcher) {
     int choice;
     bool quit = false;
     std::atomic<bool> exit(false);
     PDU_2 pdu_2;
     std::string input;
-    ssize_t bytes_sent = 0;
+    View view;
+    Filter filter;
+    char *client_id = dispatcher.client_id;
+    Catalog catalog;
 
     while (!quit) {
         // Clear the screen
@@ -255,7 +558,7 @@ void menu_handler(int port, int sockfd, struct sockaddr_in serverAddr, char *cli
         std::cin.clear();
 
         // Validate user input
-        while (std::cin.fail() || choice < 1 || choice > 5) {
+        while (std::cin.fail() || choice < 1 || choice > 6) {
             std::cin.clear();
             std::cin.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
             std::cout << "Invalid input, please try again: ";
@@ -267,26 +570,15 @@ void menu_handler(int port, int sockfd, struct sockaddr_in serverAddr, char *cli
         switch (choice) {
             case 1:  // List all
                 system(CLEAR_COMMAND);
-                populate_pdu(pdu_2, choice, "list", client_id);
-                if ((bytes_sent = sendto(sockfd, &pdu_2, sizeof(pdu_2), 0, (struct sockaddr *)&serverAddr, sizeof(serverAddr))) == -1) {
-                    std::cerr << "Failed to send response to client." << std::endl;
-                }
-                recv_pdu(client_id, choice, sockfd, pdu_2, exit);
-                display_sources(pdu_2);
+                refresh_catalog(dispatcher, catalog);
+                display_sources(catalog.sources);
                 break;
             case 2:  // Info(D)
                 system(CLEAR_COMMAND);
-                populate_pdu(pdu_2, 1, "list", client_id);
-                if ((bytes_sent = sendto(sockfd, &pdu_2, sizeof(pdu_2), 0, (struct sockaddr *)&serverAddr, sizeof(serverAddr))) == -1) {
-                    std::cerr << "Failed to send response to client." << std::endl;
-                }
-                recv_pdu(client_id, 1, sockfd, pdu_2, exit);
-                display_chooser(input, pdu_2);
+                refresh_catalog(dispatcher, catalog);
+                display_chooser(input, catalog.sources);
                 populate_pdu(pdu_2, choice, "info", client_id, "\0", input);
-                if ((bytes_sent = sendto(sockfd, &pdu_2, sizeof(pdu_2), 0, (struct sockaddr *)&serverAddr, sizeof(serverAddr))) == -1) {
-                    std::cerr << "Failed to send response to client." << std::endl;
-                }
-                recv_pdu(client_id, choice, sockfd, pdu_2, exit);
+                request(dispatcher, pdu_2);
                 system(CLEAR_COMMAND);
                 display_info(pdu_2.pdu);
                 break;
@@ -294,39 +586,52 @@ void menu_handler(int port, int sockfd, struct sockaddr_in serverAddr, char *cli
             {
                 exit.store(false);
                 system(CLEAR_COMMAND);
-                populate_pdu(pdu_2, 1, "list", client_id);
-                if ((bytes_sent = sendto(sockfd, &pdu_2, sizeof(pdu_2), 0, (struct sockaddr *)&serverAddr, sizeof(serverAddr))) == -1) {
-                    std::cerr << "Failed to send response to client." << std::endl;
-                }
-                recv_pdu(client_id, 1, sockfd, pdu_2, exit);
-                display_chooser(input, pdu_2);
+                refresh_catalog(dispatcher, catalog);
+                display_chooser(input, catalog.sources);
+                display_view_chooser(view);
+                display_filter_chooser(filter);
                 populate_pdu(pdu_2, choice, "play", client_id, input, "\0");
-                if ((bytes_sent = sendto(sockfd, &pdu_2, sizeof(pdu_2), 0, (struct sockaddr *)&serverAddr, sizeof(serverAddr))) == -1) {
-                    std::cerr << "Failed to send response to client." << std::endl;
+                pdu_2.view = view;
+                pdu_2.filter = filter;
+                if (!request(dispatcher, pdu_2) || std::strcmp(pdu_2.type, "ack") != 0) {
+                    break;
                 }
-                recv_pdu(client_id, 5, sockfd, pdu_2, exit);
                 system(CLEAR_COMMAND);
-                std::thread display_thread(display_channel, std::ref(pdu_2), sockfd, input, client_id, std::ref(exit), serverAddr, bytes_sent);
-                std::thread still_watching_thread(still_watching, 40, std::ref(exit), std::ref(pdu_2), client_id, input, sockfd, serverAddr, bytes_sent);
+                std::thread display_thread(display_channel, std::ref(dispatcher), input, view, filter, std::ref(exit));
+                std::thread still_watching_thread(still_watching, 40, std::ref(exit), std::ref(dispatcher), input);
                 display_thread.join();
                 still_watching_thread.join();
                 break;
             }
             case 4:  // Stop(D)
+            {
                 system(CLEAR_COMMAND);
-                populate_pdu(pdu_2, 6, "subd", client_id);
-                if ((bytes_sent = sendto(sockfd, &pdu_2, sizeof(pdu_2), 0, (struct sockaddr *)&serverAddr, sizeof(serverAddr))) == -1) {
-                    std::cerr << "Failed to send response to client." << std::endl;
-                }
-                recv_pdu(client_id, 6, sockfd, pdu_2, exit);
-                display_chooser(input, pdu_2);
+                std::set<std::string> subscribed;
+                load_subscriptions(dispatcher, subscribed);
+                display_chooser(input, subscribed, true);
                 populate_pdu(pdu_2, choice, "stop", client_id, "\0", input);
-                if ((bytes_sent = sendto(sockfd, &pdu_2, sizeof(pdu_2), 0, (struct sockaddr *)&serverAddr, sizeof(serverAddr))) == -1) {
-                    std::cerr << "Failed to send response to client." << std::endl;
+                request(dispatcher, pdu_2);
+                break;
+            }
+            case 5:  // Replay(D)
+            {
+                system(CLEAR_COMMAND);
+                refresh_catalog(dispatcher, catalog);
+                display_chooser(input, catalog.sources);
+                Replay replay;
+                display_replay_chooser(replay);
+                populate_pdu(pdu_2, 10, "rply", client_id, input, "\0");
+                pdu_2.replay = replay;
+                if (!request(dispatcher, pdu_2) || std::strcmp(pdu_2.type, "ack") != 0) {
+                    std::cout << "Nothing was recorded from " << input << " in that range." << std::endl;
+                    std::this_thread::sleep_for(std::chrono::seconds(2));
+                    break;
                 }
-                recv_pdu(client_id, 5, sockfd, pdu_2, exit);
+                system(CLEAR_COMMAND);
+                display_replay(dispatcher, input);
                 break;
-            case 5:  // Quit
+            }
+            case 6:  // Quit
                 quit = true;
                 break;
         }
@@ -334,15 +639,21 @@ void menu_handler(int port, int sockfd, struct sockaddr_in serverAddr, char *cli
 }
 
 void handler(const std::string ip, int port, char *client_id) {
-    int sockfd;
-    struct sockaddr_in serverAddr;
-    memset(&serverAddr, 0, sizeof(serverAddr));
+    Dispatcher dispatcher;
+    memset(&dispatcher.serverAddr, 0, sizeof(dispatcher.serverAddr));
+    dispatcher.client_id = client_id;
+    dispatcher.next_req_id.store(1);
+    dispatcher.running.store(true);
+
+    create_sender_socket(ip, port, dispatcher.sockfd, dispatcher.serverAddr);
 
-    create_sender_socket(ip, port, sockfd, serverAddr);
+    std::thread dispatch_thread(dispatch_loop, std::ref(dispatcher));
 
-    menu_handler(port, sockfd, serverAddr, client_id);
+    menu_handler(dispatcher);
 
-    close(sockfd);
+    dispatcher.running.store(false);
+    dispatch_thread.join();
+    close(dispatcher.sockfd);
 
     system(CLEAR_COMMAND);
 }
@@ -353,7 +664,9 @@ int main(int argc, char *argv[]) {
     char *program_name_ptr = new char[program_name.length() + 1];
     std::strcpy(program_name_ptr, program_name.c_str());
 
-    handler("127.0.0.1", 12347, program_name_ptr);
+    std::string ip = argc > 1 ? argv[1] : "127.0.0.1";  // SM to talk to, e.g. a relay on another port
+    int port = argc > 2 ? std::stoi(argv[2]) : 12347;
+    handler(ip, port, program_name_ptr);
 
     delete[] program_name_ptr;
     return 0;
@@ -7,6 +7,16 @@ void display_data(PDU_3 pdu_3) {
     std::cout << "Number of subscribers: " << pdu_3.n_subscribers << std::endl;
     std::cout << "Number of sources: " << pdu_3.n_sources << std::endl;
     std::cout << "------------------------------------" << std::endl;
+    std::cout << "Samples sent: " << pdu_3.egress_sent << std::endl;
+    std::cout << "Dropped (oldest): " << pdu_3.egress_dropped << std::endl;
+    std::cout << "Coalesced: " << pdu_3.egress_coalesced << std::endl;
+    std::cout << "Clients disconnected: " << pdu_3.egress_disconnected << std::endl;
+    std::cout << "Socket full (EAGAIN): " << pdu_3.egress_eagain << std::endl;
+    std::cout << "Send errors: " << pdu_3.egress_errors << std::endl;
+    std::cout << "Admissions rejected: " << pdu_3.admission_rejected << std::endl;
+    std::cout << "Requests dropped: " << pdu_3.requests_dropped << std::endl;
+    std::cout << "Allocations: " << pdu_3.allocations << " (data path: " << pdu_3.data_path_allocations << ")" << std::endl;
+    std::cout << "------------------------------------" << std::endl;
 }
 
 void receive_pdu(int port) {
@@ -36,11 +46,11 @@ void receive_pdu(int port) {
     }
 }
 
-void handler() {
-    receive_pdu(12365);
+void handler(int port) {
+    receive_pdu(port);
 }
 
-int main() {
-    handler();
+int main(int argc, char* argv[]) {
+    handler(argc > 1 ? std::stoi(argv[1]) : 12365);  // The SM's --monitor-port
     return 0;
 }
\ No newline at end of file
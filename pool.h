@@ -0,0 +1,238 @@
+#ifndef POOL_H
+#define POOL_H
+
+/* Fixed-capacity storage for the SM registries.
+   Everything is sized once, when the SM starts, from its capacity limits: a full table or pool
+   refuses new entries instead of growing, so the data path never reaches the allocator. */
+
+#include <algorithm>
+#include <vector>
+
+const uint32_t NO_ENTRY = UINT32_MAX;  // End of an intrusive list, or a lookup that found nothing
+
+uint64_t hash_bytes(const void* data, size_t size) {  // FNV-1a
+    const unsigned char* bytes = static_cast<const unsigned char*>(data);
+    uint64_t hash = 14695981039346656037ull;
+    for (size_t k = 0; k < size; k++) {
+        hash = (hash ^ bytes[k]) * 1099511628211ull;
+    }
+    return hash;
+}
+
+template <typename Key, typename Hash>
+struct FixedTable {  // Key -> uint32_t map with open addressing (linear probing), at most capacity keys
+    struct Slot {
+        bool used;       // posição ocupada
+        Key key;         // chave
+        uint32_t value;  // valor associado
+    };
+    std::vector<Slot> slots;  // pelo menos o dobro da capacidade, potência de 2
+    size_t capacity = 0;      // chaves que a tabela aceita
+    size_t count = 0;         // chaves na tabela
+
+    void init(size_t keys) {
+        size_t size = 1;
+        while (size < 2 * keys) {
+            size <<= 1;
+        }
+        slots.assign(size, Slot());
+        capacity = keys;
+        count = 0;
+    }
+
+    void clear() {
+        std::fill(slots.begin(), slots.end(), Slot());
+        count = 0;
+    }
+
+    size_t position(const Key& key) const {  // Where key is, or the free slot where it would go
+        size_t mask = slots.size() - 1;
+        size_t k = Hash()(key) & mask;
+        while (slots[k].used && !(slots[k].key == key)) {
+            k = (k + 1) & mask;
+        }
+        return k;
+    }
+
+    uint32_t find(const Key& key) const {  // NO_ENTRY if key isn't in the table
+        if (slots.empty()) {
+            return NO_ENTRY;
+        }
+        const Slot& slot = slots[position(key)];
+        return slot.used ? slot.value : NO_ENTRY;
+    }
+
+    bool insert(const Key& key, uint32_t value) {  // Adds or replaces key; false if the table is full
+        if (slots.empty()) {
+            return false;
+        }
+        Slot& slot = slots[position(key)];
+        if (!slot.used) {
+            if (count == capacity) {
+                return false;
+            }
+            slot.used = true;
+            slot.key = key;
+            count++;
+        }
+        slot.value = value;
+        return true;
+    }
+
+    void erase(const Key& key) {
+        if (slots.empty()) {
+            return;
+        }
+        size_t mask = slots.size() - 1;
+        size_t hole = position(key);
+        if (!slots[hole].used) {
+            return;
+        }
+        // Backward shift: later keys of the same probe run move into the hole, so lookups never
+        // need tombstones to find them
+        for (size_t k = (hole + 1) & mask; slots[k].used; k = (k + 1) & mask) {
+            size_t home = Hash()(slots[k].key) & mask;
+            if (((k - home) & mask) >= ((k - hole) & mask)) {
+                slots[hole] = slots[k];
+                hole = k;
+            }
+        }
+        slots[hole].used = false;
+        count--;
+    }
+};
+
+template <typename T>
+struct SlabPool {  // capacity T constructed up front, handed out by index; take and give never allocate
+    std::vector<T> items;        // todas as entradas
+    std::vector<uint32_t> free;  // entradas devolvidas, reutilizadas primeiro
+    uint32_t used = 0;           // entradas alguma vez entregues (as seguintes nunca foram usadas)
+
+    void init(size_t capacity) {
+        items.clear();
+        items.resize(capacity);
+        free.clear();
+        free.reserve(capacity);
+        used = 0;
+    }
+
+    uint32_t take() {  // NO_ENTRY if every entry is in use
+        if (!free.empty()) {
+            uint32_t index = free.back();
+            free.pop_back();
+            return index;
+        }
+        return used < items.size() ? used++ : NO_ENTRY;
+    }
+
+    void give(uint32_t index) {
+        free.push_back(index);
+    }
+
+    // Only the entries handed out at some point are visited (and counted by size)
+    T& operator[](uint32_t index) { return items[index]; }
+    const T& operator[](uint32_t index) const { return items[index]; }
+    size_t size() const { return used; }
+    size_t capacity() const { return items.size(); }
+    typename std::vector<T>::iterator begin() { return items.begin(); }
+    typename std::vector<T>::iterator end() { return items.begin() + used; }
+    typename std::vector<T>::const_iterator begin() const { return items.begin(); }
+    typename std::vector<T>::const_iterator end() const { return items.begin() + used; }
+};
+
+template <typename T, typename Less>
+struct FixedSkipList {  // Ordered T (by Less) on a SlabPool: O(log n) lookup, insert and erase, at most capacity entries
+    static const int LEVELS = 16;  // A node goes up a level with probability 1/4: enough for 4^16 entries
+    struct Node {
+        T value;                // entrada
+        uint32_t next[LEVELS];  // nó seguinte em cada nível (NO_ENTRY = fim)
+    };
+    SlabPool<Node> nodes;       // nós da lista, reutilizados depois de removidos
+    uint32_t head[LEVELS];      // primeiro nó de cada nível
+    size_t count = 0;           // entradas na lista
+    uint64_t random_state = 1;  // gerador dos níveis (xorshift, determinístico)
+
+    void init(size_t capacity) {
+        nodes.init(capacity);
+        std::fill(head, head + LEVELS, NO_ENTRY);
+        count = 0;
+    }
+
+    size_t size() const { return count; }
+    size_t capacity() const { return nodes.capacity(); }
+    T& operator[](uint32_t index) { return nodes[index].value; }
+    const T& operator[](uint32_t index) const { return nodes[index].value; }
+    uint32_t first() const { return head[0]; }                            // NO_ENTRY if empty
+    uint32_t next(uint32_t index) const { return nodes[index].next[0]; }  // In order; NO_ENTRY after the last
+
+    uint32_t lower_bound(const T& key) const {  // First entry not less than key, NO_ENTRY if none
+        uint32_t before[LEVELS];
+        return predecessors(key, before);
+    }
+
+    uint32_t insert(const T& value) {  // Index of the new entry, NO_ENTRY if the list is full
+        uint32_t before[LEVELS];
+        predecessors(value, before);
+        uint32_t index = nodes.take();
+        if (index == NO_ENTRY) {
+            return NO_ENTRY;
+        }
+        Node& node = nodes[index];
+        node.value = value;
+        int levels = random_levels();
+        for (int l = 0; l < LEVELS; l++) {
+            if (l < levels) {
+                node.next[l] = link(before[l], l);
+                link(before[l], l) = index;
+            } else {
+                node.next[l] = NO_ENTRY;
+            }
+        }
+        count++;
+        return index;
+    }
+
+    void erase(const T& key) {  // Removes the entry equal to key, if there is one
+        uint32_t before[LEVELS];
+        uint32_t index = predecessors(key, before);
+        if (index == NO_ENTRY || Less()(key, nodes[index].value)) {
+            return;
+        }
+        for (int l = 0; l < LEVELS; l++) {
+            if (link(before[l], l) == index) {
+                link(before[l], l) = nodes[index].next[l];
+            }
+        }
+        nodes.give(index);
+        count--;
+    }
+
+private:
+    uint32_t& link(uint32_t index, int level) { return index == NO_ENTRY ? head[level] : nodes[index].next[level]; }
+    uint32_t link(uint32_t index, int level) const { return index == NO_ENTRY ? head[level] : nodes[index].next[level]; }
+
+    uint32_t predecessors(const T& key, uint32_t (&before)[LEVELS]) const {
+        // Fills before with the last node less than key on each level (NO_ENTRY = the head) and returns the node after it
+        uint32_t index = NO_ENTRY;
+        for (int l = LEVELS - 1; l >= 0; l--) {
+            for (uint32_t n = link(index, l); n != NO_ENTRY && Less()(nodes[n].value, key); n = link(index, l)) {
+                index = n;
+            }
+            before[l] = index;
+        }
+        return link(index, 0);
+    }
+
+    int random_levels() {
+        random_state ^= random_state << 13;
+        random_state ^= random_state >> 7;
+        random_state ^= random_state << 17;
+        int levels = 1;
+        for (uint64_t bits = random_state; levels < LEVELS && (bits & 3) == 0; bits >>= 2) {
+            levels++;
+        }
+        return levels;
+    }
+};
+
+#endif
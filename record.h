@@ -0,0 +1,168 @@
+#ifndef RECORD_H
+#define RECORD_H
+
+/* On-disk layout of recorded streams.
+   Each source is recorded into a series of append-only segment files, preallocated to a fixed size
+   and written through a shared mapping. A segment is a page-sized header followed by fixed-size
+   records, so the record with sequence number s sits at index s - first_seq and the time of any
+   record can be binary searched (samples are stored in time order). */
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "api.h"
+
+const char SEGMENT_MAGIC[8] = "SMSEG";
+const uint32_t SEGMENT_VERSION = 1;
+const size_t SEGMENT_HEADER_SIZE = 4096;  // Records start on their own page
+
+struct SegmentHeader {
+    char magic[8];          // SEGMENT_MAGIC
+    uint32_t version;       // SEGMENT_VERSION
+    char identifier[10];    // fonte gravada
+    int32_t frequency;      // frequência da fonte durante o segmento
+    int32_t multiple;       // amostragem da fonte durante o segmento
+    uint64_t first_seq;     // número de sequência do primeiro registo
+    uint64_t capacity;      // registos que cabem no ficheiro
+    uint64_t count;         // registos escritos (só cresce depois de o registo estar escrito)
+    int64_t first_time_ns;  // instante da primeira amostra
+    int64_t last_time_ns;   // instante da última amostra
+};
+
+struct SegmentRecord {
+    int64_t time_ns;     // instante da amostra (ns desde a época)
+    int32_t i;           // número da amostra na fonte
+    int32_t value;       // amostra
+    int32_t period;      // período da fonte
+    int32_t max_period;  // número máximo de períodos
+};
+
+struct Segment {  // What the recorder and replay know about a segment file
+    std::string path;
+    int32_t frequency;
+    int32_t multiple;
+    uint64_t first_seq;
+    uint64_t count;
+    int64_t first_time_ns;
+    int64_t last_time_ns;
+    uint64_t bytes;  // espaço ocupado no disco
+};
+
+struct SegmentWriter {
+    int fd = -1;
+    SegmentHeader* header = nullptr;  // mapeamento do ficheiro inteiro
+    SegmentRecord* records = nullptr;
+    size_t size = 0;
+};
+
+int64_t sample_time_ns(const PDU_1& pdu) {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(pdu.timestamp.time_since_epoch()).count();
+}
+
+bool segment_create(SegmentWriter& writer, const std::string& path, const PDU_1& pdu, uint64_t first_seq, size_t size) {
+    // Preallocates the whole file so appends never extend it (and never fail for lack of space)
+    writer.fd = open(path.c_str(), O_RDWR | O_CREAT | O_EXCL, 0644);
+    if (writer.fd == -1) {
+        return false;
+    }
+    if (posix_fallocate(writer.fd, 0, size) != 0) {
+        close(writer.fd);
+        unlink(path.c_str());
+        writer.fd = -1;
+        return false;
+    }
+    void* mapping = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, writer.fd, 0);
+    if (mapping == MAP_FAILED) {
+        close(writer.fd);
+        unlink(path.c_str());
+        writer.fd = -1;
+        return false;
+    }
+    writer.size = size;
+    writer.header = static_cast<SegmentHeader*>(mapping);
+    writer.records = reinterpret_cast<SegmentRecord*>(static_cast<char*>(mapping) + SEGMENT_HEADER_SIZE);
+    SegmentHeader& header = *writer.header;
+    memcpy(header.magic, SEGMENT_MAGIC, sizeof(header.magic));
+    header.version = SEGMENT_VERSION;
+    memcpy(header.identifier, pdu.identifier, sizeof(header.identifier));
+    header.frequency = pdu.frequency;
+    header.multiple = pdu.multiple;
+    header.first_seq = first_seq;
+    header.capacity = (size - SEGMENT_HEADER_SIZE) / sizeof(SegmentRecord);
+    header.count = 0;
+    header.first_time_ns = sample_time_ns(pdu);
+    header.last_time_ns = header.first_time_ns;
+    return true;
+}
+
+bool segment_full(const SegmentWriter& writer) {
+    return writer.header->count == writer.header->capacity;
+}
+
+void segment_append(SegmentWriter& writer, const PDU_1& pdu) {  // The caller checks segment_full first
+    SegmentHeader& header = *writer.header;
+    // Samples are kept in time order so ranges can be searched: a sample stamped earlier than
+    // the previous one (source clock step) is recorded at the previous time
+    int64_t time_ns = std::max(sample_time_ns(pdu), header.last_time_ns);
+    writer.records[header.count] = {time_ns, pdu.i, pdu.value, pdu.period, pdu.max_period};
+    header.last_time_ns = time_ns;
+    std::atomic_thread_fence(std::memory_order_release);
+    header.count++;
+}
+
+uint64_t segment_close(SegmentWriter& writer) {  // Gives back the unused preallocation; returns the final file size
+    uint64_t used = SEGMENT_HEADER_SIZE + writer.header->count * sizeof(SegmentRecord);
+    munmap(writer.header, writer.size);
+    if (ftruncate(writer.fd, used) == -1) {
+        used = writer.size;
+    }
+    close(writer.fd);
+    writer = SegmentWriter();
+    return used;
+}
+
+bool segment_load(const std::string& path, Segment& segment, std::string& identifier) {  // Reads a segment left on disk
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd == -1) {
+        return false;
+    }
+    SegmentHeader header;
+    struct stat info;
+    bool valid = pread(fd, &header, sizeof(header), 0) == sizeof(header) && fstat(fd, &info) == 0 &&
+                 memcmp(header.magic, SEGMENT_MAGIC, sizeof(header.magic)) == 0 && header.version == SEGMENT_VERSION;
+    close(fd);
+    if (!valid) {
+        return false;
+    }
+    // A crash can leave count ahead of what reached the disk: trust only whole records in the file
+    uint64_t stored = info.st_size > static_cast<off_t>(SEGMENT_HEADER_SIZE) ? (info.st_size - SEGMENT_HEADER_SIZE) / sizeof(SegmentRecord) : 0;
+    identifier.assign(header.identifier, strnlen(header.identifier, sizeof(header.identifier)));
+    segment = {path, header.frequency, header.multiple, header.first_seq, std::min(header.count, stored),
+               header.first_time_ns, header.last_time_ns, static_cast<uint64_t>(info.st_size)};
+    return segment.count > 0;
+}
+
+size_t segment_read(int fd, uint64_t first, SegmentRecord* records, size_t n) {  // Records [first, first + n) of an open segment file
+    ssize_t bytes = pread(fd, records, n * sizeof(SegmentRecord), SEGMENT_HEADER_SIZE + first * sizeof(SegmentRecord));
+    return bytes > 0 ? bytes / sizeof(SegmentRecord) : 0;
+}
+
+uint64_t segment_find_time(int fd, uint64_t count, int64_t time_ns) {  // Index of the first record at or after time_ns
+    uint64_t low = 0;
+    uint64_t high = count;
+    while (low < high) {
+        uint64_t middle = low + (high - low) / 2;
+        SegmentRecord record;
+        if (segment_read(fd, middle, &record, 1) != 1) {
+            return count;
+        }
+        if (record.time_ns < time_ns) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return low;
+}
+
+#endif
@@ -1,332 +1,2667 @@
+#include "alloc.h"
 #include "api.h"
+#include "pool.h"
+#include "record.h"
+#include "snapshot.h"
+#include "topology.h"
+#include "trace.h"
+#include "uring.h"
 
 std::atomic<bool> keep_running(true);
 std::atomic<bool> new_notification(false);
 
+enum IoBackend { IO_SOCKET, IO_URING };
+IoBackend io_backend = IO_SOCKET;  // Chosen with --io; io_uring falls back to plain sockets when unavailable
+
+const int IO_BATCH = 32;                                                // Datagrams received or sent per system call
+const size_t REQUEST_SIZE = std::max(sizeof(PDU_2), sizeof(PDU_4));  // Largest datagram a client sends
+
+struct NodeConfig {
+    int ingest_port = 12345;                // porta onde as fontes enviam amostras
+    int control_port = 12347;               // porta dos pedidos dos clientes
+    std::string monitor_ip = "127.0.0.1";   // para onde vão as estatísticas
+    int monitor_port = 12365;               // porta do monitor
+    std::string upstream_ip;                // SM de onde retransmitir fontes ("" = nenhum)
+    int upstream_port = 0;                  // porta de controlo desse SM
+};
+NodeConfig node_config;
+
+struct StateConfig {
+    std::string path;           // ficheiro onde o estado é guardado ("" = não guardar)
+    uint32_t interval_s = 10;   // intervalo entre gravações do estado (0 = só ao terminar)
+    std::string handoff_path;   // socket Unix por onde um SM novo recebe os sockets e o estado ("" = nenhum)
+};
+StateConfig state_config;
+std::atomic<int> handoff_conn(-1);  // Connection of the SM process taking over, once one asked
+
+std::mutex stop_mutex;            // Only used to wait on stop_cv
+std::condition_variable stop_cv;  // Wakes up main and the cleanup thread, which sleep between rounds, when the SM stops
+
+const int RELAY_REFILL_BELOW = 50;                     // Upstream credits left when the relay plays again
+const std::chrono::milliseconds RELAY_PERIOD(100);     // How often the relay looks for sources to (un)subscribe
+const std::chrono::milliseconds RELAY_RETRY(1000);     // Play again when a subscription got no data for this long
+const std::chrono::seconds RELAY_CATALOG_PERIOD(1);    // How often the upstream catalog is polled
+const std::chrono::seconds RELAY_TOLERANCE(1);         // Relayed sources expire after this much extra silence
+
+enum ThreadRole { ROLE_INGEST, ROLE_FANOUT, ROLE_CONTROL, ROLE_OTHER, THREAD_ROLES };
+const char* THREAD_ROLE_NAMES[THREAD_ROLES] = {"ingest", "fanout", "control", "other"};
+const int MAX_ROLE_THREADS = 64;
+
+struct TopologyConfig {
+    int ingest_threads = 1;          // threads a receber amostras (todos do mesmo socket)
+    int fanout_threads = 1;          // threads a enviar para os clientes (cada cliente fica sempre no mesmo)
+    int control_threads = 4;         // threads a responder aos pedidos dos clientes
+    bool pinned[THREAD_ROLES] = {};  // o papel tem um conjunto de cores
+    cpu_set_t cpus[THREAD_ROLES];    // cores de cada papel
+    int rt_priority = 0;             // prioridade SCHED_FIFO dos threads de ingest e fan-out (0 = escalonamento normal)
+    bool mlock = false;              // mlockall antes de arrancar os threads
+};
+TopologyConfig topology;
+
+void start_thread(const char* name, ThreadRole role) {  // Registers the calling thread with the flight recorder and places it
+    trace_thread(name);
+    count_thread_allocations(name);
+    if (topology.pinned[role] && !pin_thread(topology.cpus[role])) {
+        throw std::runtime_error(std::string("can't pin the ") + name + " thread to its cores");
+    }
+    if (topology.rt_priority > 0 && (role == ROLE_INGEST || role == ROLE_FANOUT) && !set_fifo_priority(topology.rt_priority)) {
+        throw std::runtime_error(std::string("can't give the ") + name + " thread its SCHED_FIFO priority");
+    }
+}
+
+std::string trace_path = "sm.trace";           // Where the flight recorder is dumped
+std::atomic<bool> trace_dump_requested(false);  // Set by SIGUSR1, served by the cleanup thread
+
 std::mutex sources_mutex;    // Mutex for accessing the list of active pdu's
 std::mutex client_mutex;     // Mutex for accessing the list of subscribed clients
 std::condition_variable cv;  // Condition variable for signaling between threads
 
-std::unordered_map<std::string, PDU_1> sources_map;
-std::unordered_map<in_port_t, Subscriber> subscriber_list;
+std::mutex request_mutex;  // Mutex for accessing the queues of pending client requests
+
+struct Request {
+    PDU_2 pdu_2;  // pedido do cliente (sempre com o endereço do cliente)
+    PDU_4 pdu_4;  // pedido ao catálogo (só para os ids 7 e 8)
+};
+
+const size_t MAX_REQUEST_QUEUE = 1024;  // Requests waiting for one worker; later ones are dropped (clients retry)
+
+struct RequestQueue {  // One per worker
+    std::condition_variable cv;     // acorda o worker quando chega um pedido
+    std::vector<Request> requests;  // anel de MAX_REQUEST_QUEUE pedidos, alocado no arranque
+    size_t head = 0;                // pedido mais antigo
+    size_t count = 0;               // pedidos em espera
+};
+
+// A client's requests always go to the same worker, so they are applied in the order they were sent
+// (a credit refill play and the stop after it); different clients are still served in parallel
+std::vector<std::unique_ptr<RequestQueue>> request_queues;
+std::atomic<uint64_t> requests_dropped(0);
+
+void wake_request_workers() {
+    for (auto& queue : request_queues) {
+        queue->cv.notify_all();
+    }
+}
+
+struct CatalogChange {
+    uint64_t version;     // versão do catálogo após a alteração
+    char identifier[10];  // fonte adicionada ou removida
+    bool removed;
+};
+
+struct CatalogSource {
+    char identifier[10];  // fonte listada
+    uint8_t origins;      // CatalogOrigin de quem a oferece
+};
+
+const size_t MAX_CATALOG_CHANGES = 4096;  // Older changes are forgotten; clients then relist
+
+std::mutex catalog_mutex;  // Mutex for accessing the catalog (taken after sources_mutex)
+uint64_t catalog_version = 0;
+enum CatalogOrigin : uint8_t { CATALOG_LOCAL = 1, CATALOG_UPSTREAM = 2 };
+struct CatalogLess {
+    bool operator()(const CatalogSource& a, const CatalogSource& b) const { return memcmp(a.identifier, b.identifier, sizeof(a.identifier)) < 0; }
+};
+
+// Active sources (and where they come from), sorted by identifier so pages are stable. Sized at startup
+// for our sources and as many upstream ones; sources beyond that are served but not listed
+FixedSkipList<CatalogSource, CatalogLess> catalog_sources;
+std::vector<CatalogChange> catalog_changes;  // Ring of MAX_CATALOG_CHANGES, the oldest at catalog_changes_head
+size_t catalog_changes_head = 0;
+size_t catalog_changes_count = 0;
+
+struct CapacityConfig {
+    size_t max_sources = 16384;        // fontes distintas durante a vida do SM (os handles não são reutilizados)
+    size_t max_clients = 1024;         // clientes com subscrições ao mesmo tempo
+    size_t max_subscriptions = 16384;  // subscrições ao mesmo tempo
+};
+CapacityConfig capacity_config;
+
+const size_t MAX_VIEWS_PER_SOURCE = 8;  // Different views of one source played at the same time
+std::atomic<uint64_t> admission_rejected(0);  // Samples of new sources, clients, subscriptions or views refused for lack of room
+
+struct SourceSlot {
+    bool active;                 // fonte ativa (recebeu amostras dentro do período)
+    bool relayed;                // amostras chegam de um SM acima e não da própria fonte
+    bool pending;                // última amostra ainda não distribuída
+    PDU_1 pdu;                   // última amostra recebida
+    bool keep_backlog;           // há vistas decimadas ou agregadas que precisam de todas as amostras
+    std::vector<PDU_1> backlog;  // amostras recebidas desde a última distribuição (só com keep_backlog)
+};
+
+const size_t MAX_BACKLOG = 1024;  // Samples kept per source between two fan-outs; later ones skip the views
+
+struct SourceKey {
+    char identifier[10];  // identificador da fonte (terminado em zeros)
+
+    bool operator==(const SourceKey& other) const { return memcmp(identifier, other.identifier, sizeof(identifier)) == 0; }
+};
+
+struct SourceKeyHash {
+    size_t operator()(const SourceKey& key) const { return hash_bytes(key.identifier, strnlen(key.identifier, sizeof(key.identifier))); }
+};
+
+// Source IDs are interned into dense handles (slot index + 1) the first time a source is seen;
+// sources then send their handle and the data path indexes source_slots directly.
+// Handles are never recycled, so subscriptions survive a source going quiet and coming back.
+// Both hold capacity_config.max_sources, reserved at startup: later sources are refused
+FixedTable<SourceKey, SourceKeyHash> source_handles;  // Only used at registration and by control requests
+std::vector<SourceSlot> source_slots;
+std::vector<uint32_t> dirty_sources;  // Handles with a sample waiting for fan-out (each at most once)
+std::atomic<size_t> n_active_sources(0);
+std::atomic<int> ingest_receivers(0);  // Ingest threads still reading the ingest socket
+
+enum SlowConsumerPolicy { DROP_OLDEST, COALESCE, DISCONNECT };
+
+struct EgressConfig {
+    size_t queue_depth = 8;                   // PDUs em espera por cliente
+    double rate = 0;                          // PDUs por segundo por cliente (0 = sem limite)
+    double burst = 32;                        // PDUs que um cliente pode receber de seguida
+    SlowConsumerPolicy policy = DROP_OLDEST;  // o que fazer quando a fila de um cliente enche
+    int max_errors = 16;                      // envios falhados seguidos até desligar (política disconnect)
+};
+EgressConfig egress_config;
+
+struct EgressItem {
+    uint32_t subscription;  // subscrição a que o PDU pertence
+    PDU_2 pdu;
+};
+
+struct EgressQueue {
+    std::mutex mutex;                                   // protege a fila e o balde de tokens
+    struct sockaddr_in clientAddr;                      // endereço do cliente
+    std::vector<EgressItem> items;                      // anel com queue_depth posições
+    size_t head = 0;                                    // posição do PDU mais antigo
+    size_t count = 0;                                   // PDUs em espera
+    double tokens = 0;                                  // PDUs que o cliente ainda pode receber agora
+    std::chrono::steady_clock::time_point last_refill;  // última atualização dos tokens
+    std::atomic<int> errors{0};                         // envios falhados seguidos
+    bool scheduled = false;                             // a fila está na lista do egress thread
+    uint32_t lane = 0;                                  // egress thread que serve o cliente
+    std::atomic<bool> closed{false};                    // cliente removido
+    std::atomic<bool> disconnect{false};                // cliente a desligar por não acompanhar
+};
+
+enum EgressResult { QUEUED, COALESCED, REFUSED };
+
+struct EgressLane {  // One per egress thread
+    std::mutex mutex;                                 // protege ready (tomado depois do mutex de uma fila)
+    std::vector<std::shared_ptr<EgressQueue>> ready;  // filas com PDUs desde a última passagem do thread
+    std::atomic<bool> woken{false};                   // já há PDUs novos para este thread nesta passagem do fan-out
+    std::atomic<int> event{-1};                       // eventfd que acorda o thread
+};
+
+std::vector<std::unique_ptr<EgressLane>> egress_lanes;  // Sized at startup; a client always goes through the same lane
+
+std::atomic<uint64_t> egress_sent(0);
+std::atomic<uint64_t> egress_dropped(0);
+std::atomic<uint64_t> egress_coalesced(0);
+std::atomic<uint64_t> egress_disconnected(0);
+std::atomic<uint64_t> egress_eagain(0);
+std::atomic<uint64_t> egress_errors(0);
+
+struct EndpointKey {
+    in_addr_t addr;       // endereço IP do cliente
+    in_port_t port;       // porta do cliente
+    char client_id[10];   // identificador do cliente
+
+    bool operator==(const EndpointKey& other) const {
+        return addr == other.addr && port == other.port && strncmp(client_id, other.client_id, sizeof(client_id)) == 0;
+    }
+};
+
+struct EndpointKeyHash {
+    size_t operator()(const EndpointKey& key) const {
+        uint64_t endpoint = (static_cast<uint64_t>(key.addr) << 16) | key.port;
+        return hash_bytes(key.client_id, strnlen(key.client_id, sizeof(key.client_id))) ^ (endpoint * 0x9e3779b97f4a7c15ull);
+    }
+};
+
+struct ClientEntry {
+    bool active;                          // entrada em uso
+    EndpointKey key;                      // endpoint e identificador do cliente
+    struct sockaddr_in clientAddr;        // endereço para onde enviar
+    uint32_t first_subscription;          // primeira subscrição do cliente (lista ligada por next_in_client)
+    uint32_t n_subscriptions;             // subscrições do cliente
+    std::shared_ptr<EgressQueue> egress;  // PDUs à espera de serem enviados ao cliente
+};
+
+struct Subscription {
+    bool active;             // subscrição em uso
+    uint32_t client;         // handle do cliente em clients
+    uint32_t next_in_client; // subscrição seguinte do mesmo cliente (NO_ENTRY = última)
+    uint32_t prev_in_client; // subscrição anterior do mesmo cliente (NO_ENTRY = primeira)
+    uint32_t next_in_view;   // subscrição seguinte da mesma vista
+    uint32_t prev_in_view;   // subscrição anterior da mesma vista
+    uint32_t source;         // handle da source subscrita
+    char source_id[10];      // identificador da source subscrita
+    int credits;             // creditos disponiveis
+    uint32_t view;           // índice da vista em source_views
+    Filter filter;           // predicado de entrega
+    bool delivered;          // já foi entregue alguma amostra (a primeira passa sempre o filtro)
+    int last_value;          // último valor entregue
+    std::chrono::steady_clock::time_point last_delivery;  // instante da última entrega
+};
+
+const uint32_t MAX_WINDOW_MS = 60000;  // Longest aggregation window a client may ask for
+
+struct SourceView {
+    bool active;                          // vista em uso
+    View view;                            // decimação ou janela pedida
+    uint64_t seen;                        // amostras recebidas desde que a vista existe
+    int64_t window;                       // janela em curso (-1 = nenhuma)
+    double sum;                           // soma das amostras da janela em curso
+    Aggregate aggregate;                  // resumo da janela em curso
+    PDU_1 last;                           // última amostra da janela em curso
+    uint32_t first_subscription;          // primeira subscrição que usa a vista (lista ligada por next_in_view)
+    uint32_t n_subscriptions;             // subscrições que usam a vista
+};
+
+// Subscriptions are addressed by dense integer handles (indexes into clients/subscriptions), taken
+// from pools sized at startup; the endpoint table is only used by control requests to find a client's handle
+FixedTable<EndpointKey, EndpointKeyHash> client_index;
+SlabPool<ClientEntry> clients;
+SlabPool<Subscription> subscriptions;
+// Egress queues outlive their client while an egress thread still holds them, so there are more than
+// clients; a queue is reused once the pool holds its only reference
+std::vector<std::shared_ptr<EgressQueue>> egress_pool;
+size_t egress_pool_next = 0;  // Where the search for a free queue starts
+// Subscribers asking for the same view of a source share one SourceView, so decimation and
+// window aggregates are computed once per source and view, whatever the number of subscribers
+std::vector<std::vector<SourceView>> source_views;  // Views per source handle - 1 (at most MAX_VIEWS_PER_SOURCE)
+std::atomic<size_t> n_subscriptions(0);
+
+struct RecordConfig {
+    std::string dir;                          // diretório das gravações ("" = não gravar)
+    size_t segment_size = 4 << 20;            // bytes pré-alocados por segmento
+    uint64_t retention_bytes = 1ull << 30;    // espaço máximo ocupado pelos segmentos fechados e abertos
+    uint64_t retention_s = 0;                 // idade máxima de um segmento fechado (0 = sem limite)
+    double replay_rate = 20000;               // amostras por segundo por repetição, no máximo
+};
+RecordConfig record_config;
+
+const size_t MAX_RECORD_QUEUE = 65536;                  // Samples waiting for the recorder; later ones are dropped
+const std::chrono::seconds RECORD_IDLE_CLOSE(5);        // Segments of sources silent this long are closed
+const std::chrono::seconds RECORD_RETRY(1);             // Wait after failing to create a segment
+const int SEGMENT_NAME_ATTEMPTS = 8;                    // Names tried for a new segment while they are taken
+
+std::mutex record_mutex;            // Mutex for accessing record_queue
+std::condition_variable record_cv;  // Wakes up the recorder
+std::vector<PDU_1> record_queue;    // Samples ingested since the recorder last looked
+std::atomic<uint64_t> record_dropped(0);  // Samples not recorded: queue full, or no segment could be created
+
+struct Recording {
+    std::vector<Segment> segments;                     // segmentos por ordem (o último está aberto se writer.fd != -1)
+    SegmentWriter writer;                              // segmento em escrita
+    uint64_t next_seq = 0;                             // sequência da próxima amostra
+    std::chrono::steady_clock::time_point last_append; // última amostra escrita
+    std::chrono::steady_clock::time_point retry_after; // não tentar criar segmentos antes disto
+};
+
+// The recorder thread alone writes segment files; replay only reads them, using the segment
+// lists (protected by recordings_mutex) to know what is on disk
+std::mutex recordings_mutex;
+std::unordered_map<std::string, Recording> recordings;
+
+std::mutex replay_mutex;              // Mutex for accessing replay_requests
+std::condition_variable replay_cv;    // Wakes up the replay thread
+std::deque<PDU_2> replay_requests;    // Replay requests not yet started
+
+void catalog_key(const char* identifier, char (&key)[10]) {  // identifier as the catalog stores it: at most 9 characters, zero padded
+    memset(key, 0, sizeof(key));
+    memcpy(key, identifier, strnlen(identifier, sizeof(key) - 1));
+}
+
+uint32_t catalog_position(const char (&key)[10]) {  // Called with catalog_mutex held: first entry >= key, NO_ENTRY if none
+    CatalogSource wanted = {};
+    memcpy(wanted.identifier, key, sizeof(key));
+    return catalog_sources.lower_bound(wanted);
+}
+
+bool catalog_lists(uint32_t entry, const char (&key)[10]) {  // Whether the entry catalog_position found is key itself
+    return entry != NO_ENTRY && memcmp(catalog_sources[entry].identifier, key, sizeof(key)) == 0;
+}
+
+void catalog_update(const char* identifier, bool removed, CatalogOrigin origin = CATALOG_LOCAL) {
+    // Local sources are updated with sources_mutex held. A source offered both locally and upstream
+    // is listed once, and only leaves the catalog when neither offers it any more
+    char key[10];
+    catalog_key(identifier, key);
+    auto lock = traced_lock(catalog_mutex, LOCK_CATALOG);
+    uint32_t entry = catalog_position(key);
+    bool listed = catalog_lists(entry, key);
+    uint8_t origins = listed ? catalog_sources[entry].origins : 0;
+    uint8_t updated = removed ? origins & ~origin : origins | origin;
+    if (updated == origins) {
+        return;
+    }
+    CatalogSource source = {};
+    memcpy(source.identifier, key, sizeof(key));
+    source.origins = updated;
+    if (updated == 0) {
+        catalog_sources.erase(source);
+    } else if (listed) {
+        catalog_sources[entry].origins = updated;
+    } else if (catalog_sources.insert(source) == NO_ENTRY) {
+        return;  // The catalog is full: the source is still served, it just isn't listed
+    }
+    if ((origins == 0) == (updated == 0)) {
+        return;  // Still listed (or still not): nothing changed for clients
+    }
+    catalog_version++;
+    CatalogChange& change = catalog_changes[(catalog_changes_head + catalog_changes_count) % MAX_CATALOG_CHANGES];
+    if (catalog_changes_count == MAX_CATALOG_CHANGES) {
+        catalog_changes_head = (catalog_changes_head + 1) % MAX_CATALOG_CHANGES;  // The oldest change is overwritten
+    } else {
+        catalog_changes_count++;
+    }
+    change.version = catalog_version;
+    memcpy(change.identifier, key, sizeof(key));
+    change.removed = removed;
+}
+
+bool offered_upstream(const char* identifier) {  // Whether the upstream SM lists the source
+    char key[10];
+    catalog_key(identifier, key);
+    auto lock = traced_lock(catalog_mutex, LOCK_CATALOG);
+    uint32_t entry = catalog_position(key);
+    return catalog_lists(entry, key) && (catalog_sources[entry].origins & CATALOG_UPSTREAM);
+}
+
+SourceKey source_key(const char* identifier) {
+    SourceKey key = {};
+    memcpy(key.identifier, identifier, strnlen(identifier, sizeof(key.identifier)));
+    return key;
+}
+
+uint32_t intern_source(const char* identifier) {  // Called with sources_mutex held; 0 if the registry is full
+    SourceKey key = source_key(identifier);
+    uint32_t found = source_handles.find(key);
+    if (found != NO_ENTRY) {
+        return found;
+    }
+    if (source_slots.size() == capacity_config.max_sources) {
+        admission_rejected++;
+        return 0;
+    }
+    source_slots.emplace_back();  // Within the capacity reserved at startup
+    source_slots.back() = {};
+    memcpy(source_slots.back().pdu.identifier, key.identifier, sizeof(key.identifier));  // Named before its first sample (relayed plays)
+    uint32_t handle = source_slots.size();
+    source_handles.insert(key, handle);
+    return handle;
+}
+
+int32_t find_source(const char* identifier) {  // Called with sources_mutex held, -1 if never seen
+    uint32_t found = source_handles.find(source_key(identifier));
+    return found == NO_ENTRY ? -1 : static_cast<int32_t>(found);
+}
+
+void ingest_batch(PDU_1* pdus, const struct sockaddr_in* addrs, int n, int sockfd, bool relayed = false) {
+    // Stores a batch of samples under a single lock and wakes up the fan-out once.
+    // Relayed samples come from an upstream SM with pdu.handle already set to our handle
+    bool registered[IO_BATCH];
+    trace(TRACE_PACKETS_RECEIVED, n);
+    {
+        auto lock = traced_lock(sources_mutex, LOCK_SOURCES);
+        for (int k = 0; k < n; k++) {
+            PDU_1& pdu = pdus[k];
+            uint32_t handle = pdu.handle;
+            registered[k] = false;
+            if (handle == 0 || handle > source_slots.size() ||
+                strncmp(source_slots[handle - 1].pdu.identifier, pdu.identifier, sizeof(pdu.identifier)) != 0) {
+                handle = intern_source(pdu.identifier);
+                if (handle == 0) {  // No room for another source: its samples are dropped and it gets no handle
+                    pdu.handle = 0;
+                    continue;
+                }
+                registered[k] = true;
+            }
+            SourceSlot& slot = source_slots[handle - 1];
+            if (relayed && slot.active && !slot.relayed) {
+                continue;  // The source also feeds us directly: the relay stops asking upstream for it
+            }
+            // Only sources fed directly are listed as ours: the relay thread keeps the upstream ones in the catalog
+            if (!slot.active) {
+                slot.active = true;
+                n_active_sources++;
+                if (!relayed) {
+                    catalog_update(pdu.identifier, false);
+                }
+            } else if (slot.relayed && !relayed) {
+                catalog_update(pdu.identifier, false);  // The source now also feeds us directly
+            }
+            slot.relayed = relayed;
+            pdu.handle = handle;
+            if (pdu.period == 0) {  // Period 0 only announces the source: it keeps it alive but carries no sample
+                if (!slot.pending) {
+                    slot.pdu = pdu;
+                }
+                continue;
+            }
+            slot.pdu = pdu;
+            if (slot.keep_backlog && slot.backlog.size() < MAX_BACKLOG) {
+                slot.backlog.push_back(slot.pdu);  // Capacity reserved when the first view asked for it
+            }
+            if (!slot.pending) {
+                slot.pending = true;
+                dirty_sources.push_back(handle);
+            }
+        }
+    }
+    if (!record_config.dir.empty()) {  // The recorder thread writes them to disk, off the ingest and fan-out paths
+        auto lock = traced_lock(record_mutex, LOCK_RECORD);
+        for (int k = 0; k < n; k++) {
+            if (pdus[k].period == 0 || pdus[k].handle == 0) {
+                continue;
+            }
+            if (record_queue.size() == MAX_RECORD_QUEUE) {
+                record_dropped++;
+                continue;
+            }
+            record_queue.push_back(pdus[k]);
+        }
+        lock.unlock();
+        record_cv.notify_one();
+    }
+    for (int k = 0; k < n; k++) {
+        if (registered[k] && !relayed) {  // Tell the source its handle so it can send it from now on
+            if (sendto(sockfd, &pdus[k], sizeof(PDU_1), 0, (struct sockaddr*)&addrs[k], sizeof(addrs[k])) == -1) {
+                std::cerr << "Failed to send handle to source." << std::endl;
+            }
+        }
+    }
+    new_notification.store(true);
+    cv.notify_one();
+}
+
+bool valid_sample(const PDU_1& pdu, size_t length) {
+    return length == sizeof(PDU_1) && pdu.frequency > 0 && pdu.multiple > 0;
+}
+
+void receive_pdu_socket(int sockfd) {  // Receives up to IO_BATCH samples per recvmmsg
+    PDU_1 pdus[IO_BATCH];
+    struct sockaddr_in addrs[IO_BATCH];
+    struct iovec iovs[IO_BATCH];
+    struct mmsghdr msgs[IO_BATCH];
+    memset(msgs, 0, sizeof(msgs));
+    for (int k = 0; k < IO_BATCH; k++) {
+        iovs[k].iov_base = &pdus[k];
+        iovs[k].iov_len = sizeof(PDU_1);
+        msgs[k].msg_hdr.msg_name = &addrs[k];
+        msgs[k].msg_hdr.msg_iov = &iovs[k];
+        msgs[k].msg_hdr.msg_iovlen = 1;
+    }
+
+    thread_warmed_up();
+    while (keep_running.load()) {
+        for (int k = 0; k < IO_BATCH; k++) {
+            msgs[k].msg_hdr.msg_namelen = sizeof(addrs[k]);
+        }
+        int n = recvmmsg(sockfd, msgs, IO_BATCH, MSG_WAITFORONE, nullptr);
+        if (n < 0) {
+            if (errno == EINTR || errno == EAGAIN) {
+                continue;
+            }
+            std::cerr << "Failed to receive data." << std::endl;
+            return;
+        }
+        int valid = 0;
+        for (int k = 0; k < n; k++) {
+            if (!valid_sample(pdus[k], msgs[k].msg_len)) {
+                continue;  // Not a sample from a compatible source
+            }
+            if (valid != k) {
+                pdus[valid] = pdus[k];
+                addrs[valid] = addrs[k];
+            }
+            valid++;
+        }
+        if (valid > 0) {
+            ingest_batch(pdus, addrs, valid, sockfd);
+        }
+    }
+}
+
+#ifdef SM_HAVE_IO_URING
+bool receive_pdu_uring(int sockfd) {  // Multishot recvmsg into provided buffers; false if the ring can't be set up or fails
+    Uring ring;
+    UringBufRing buffers;
+    if (!uring_init(ring, 64)) {
+        return false;
+    }
+    if (!uring_setup_buf_ring(ring, buffers, 0, 256, 256)) {
+        uring_exit(ring);
+        return false;
+    }
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_namelen = sizeof(struct sockaddr_in);
+    PDU_1 pdus[IO_BATCH];
+    struct sockaddr_in addrs[IO_BATCH];
+    bool armed = false;
+    bool failed = false;
+
+    thread_warmed_up();
+    while (keep_running.load()) {
+        if (!armed) {
+            uring_prep_recvmsg_multishot(uring_get_sqe(ring), sockfd, &msg, buffers.bgid, 0);
+            armed = true;
+        }
+        if (uring_submit(ring, 1) < 0) {  // The caller goes on with plain sockets rather than leave the port unread
+            std::cerr << "Failed to wait for io_uring completions (" << strerror(errno) << "), using plain sockets." << std::endl;
+            failed = true;
+            break;
+        }
+        int n = 0;
+        struct io_uring_cqe* cqe;
+        while ((cqe = uring_peek_cqe(ring)) != nullptr) {
+            if (cqe->res >= 0 && (cqe->flags & IORING_CQE_F_BUFFER)) {
+                struct sockaddr_in addr;
+                char* payload;
+                size_t length;
+                if (uring_recvmsg_payload(buffers, cqe, msg, addr, payload, length) && length == sizeof(PDU_1)) {
+                    memcpy(&pdus[n], payload, sizeof(PDU_1));
+                    addrs[n] = addr;
+                    if (valid_sample(pdus[n], length)) {
+                        n++;
+                    }
+                }
+                uring_recycle_buffer(buffers, cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+            } else if (cqe->res < 0 && cqe->res != -ENOBUFS) {
+                std::cerr << "Failed to receive data: " << strerror(-cqe->res) << std::endl;
+            }
+            if (!(cqe->flags & IORING_CQE_F_MORE)) {
+                armed = false;  // The multishot request ended (e.g. out of buffers): arm it again
+            }
+            uring_cqe_seen(ring);
+            if (n == IO_BATCH) {
+                ingest_batch(pdus, addrs, n, sockfd);
+                n = 0;
+            }
+        }
+        if (n > 0) {
+            ingest_batch(pdus, addrs, n, sockfd);
+        }
+    }
+    uring_free_buf_ring(buffers);
+    uring_exit(ring);
+    return !failed;
+}
+#endif
+
+void wake_receiver(int port) {  // recvmmsg and io_uring receives only return with a datagram: send an empty one
+    int sockfd;
+    struct sockaddr_in addr;
+    create_sender_socket("127.0.0.1", port, sockfd, addr);
+    if (sockfd != -1) {
+        sendto(sockfd, "", 0, 0, (struct sockaddr*)&addr, sizeof(addr));
+        close(sockfd);
+    }
+}
 
-void receive_pdu(int port) {
+void receive_pdu(int sockfd) {
     try { /* Continuously listen for incoming PDUs from sources
              Update the list of active sources and signal the main thread
-             whenever a new PDU is received and processed */
-        int sockfd;
-        struct sockaddr_in serverAddr, clientAddr;
-        memset(&serverAddr, 0, sizeof(serverAddr));
+             whenever new PDUs are received and processed */
+        start_thread("ingest", ROLE_INGEST);
+        bool received = false;
+#ifdef SM_HAVE_IO_URING
+        received = io_backend == IO_URING && receive_pdu_uring(sockfd);
+#endif
+        if (!received) {
+            receive_pdu_socket(sockfd);  // main owns the socket: it may be handed to the next SM process
+        }
+        // One wake-up datagram may have reached a thread in the same batch as another: pass it on
+        if (ingest_receivers.fetch_sub(1) > 1) {
+            wake_receiver(node_config.ingest_port);
+        }
+    } catch (const std::exception& e) {
+        std::cerr << "Exception in received_pdu: " << e.what() << std::endl;
+        keep_running.store(false);
+        cv.notify_all();
+    }
+}
 
-        create_receiver_socket(port, sockfd, serverAddr);
+void fill_subscriber(Subscriber& sub, const Subscription& subscription) {  // Called with client_mutex held
+    const ClientEntry& client = clients[subscription.client];
+    sub = {};
+    memcpy(sub.client_id, client.key.client_id, sizeof(sub.client_id));
+    memcpy(sub.source_id, subscription.source_id, sizeof(sub.source_id));
+    sub.credits = subscription.credits;
+    sub.clientAddr = client.clientAddr;
+}
 
-        while (keep_running.load()) {
-            memset(&clientAddr, 0, sizeof(clientAddr));
-            socklen_t clientAddrLen = sizeof(clientAddr);
+EndpointKey endpoint_key(const Subscriber& sub) {
+    EndpointKey key = {};
+    key.addr = sub.clientAddr.sin_addr.s_addr;
+    key.port = sub.clientAddr.sin_port;
+    memcpy(key.client_id, sub.client_id, sizeof(key.client_id) - 1);
+    return key;
+}
+
+int32_t find_client(const Subscriber& sub) {  // Called with client_mutex held, -1 if unknown
+    uint32_t client = client_index.find(endpoint_key(sub));
+    return client == NO_ENTRY ? -1 : static_cast<int32_t>(client);
+}
+
+std::shared_ptr<EgressQueue> take_egress_queue() {  // Called with client_mutex held; nullptr if every queue is still in use
+    for (size_t k = 0; k < egress_pool.size(); k++) {
+        std::shared_ptr<EgressQueue>& queue = egress_pool[(egress_pool_next + k) % egress_pool.size()];
+        if (queue.use_count() == 1) {  // Only the pool holds it: no client, fan-out or egress thread can get it back
+            std::atomic_thread_fence(std::memory_order_acquire);  // See everything the egress thread did before letting go
+            egress_pool_next = (egress_pool_next + k + 1) % egress_pool.size();
+            return queue;
+        }
+    }
+    return nullptr;
+}
+
+int32_t add_client(const Subscriber& sub) {  // Called with client_mutex held; -1 if there is no room for another client
+    std::shared_ptr<EgressQueue> egress = take_egress_queue();
+    if (egress == nullptr || client_index.count == client_index.capacity) {
+        admission_rejected++;
+        return -1;
+    }
+    uint32_t handle = clients.take();  // Never fails: there are as many clients as client_index has room for
+    ClientEntry& client = clients[handle];
+    client.active = true;
+    client.key = endpoint_key(sub);
+    client.clientAddr = sub.clientAddr;
+    client.first_subscription = NO_ENTRY;
+    client.n_subscriptions = 0;
+    client.egress = egress;
+    egress->clientAddr = sub.clientAddr;
+    egress->lane = handle % egress_lanes.size();
+    egress->head = 0;
+    egress->count = 0;
+    egress->tokens = egress_config.burst;
+    egress->last_refill = std::chrono::steady_clock::now();
+    egress->errors.store(0);
+    egress->scheduled = false;
+    egress->closed.store(false);
+    egress->disconnect.store(false);
+    client_index.insert(client.key, handle);
+    return handle;
+}
+
+void remove_client(uint32_t handle) {  // Called with client_mutex held, once the client has no subscription left
+    ClientEntry& client = clients[handle];
+    client.active = false;
+    client.egress->closed.store(true);
+    client.egress.reset();  // Back to the pool once the egress thread lets go of it too
+    client_index.erase(client.key);
+    clients.give(handle);
+}
+
+int32_t find_subscription(uint32_t client, const char* source_id) {  // Called with client_mutex held, -1 if none
+    for (uint32_t handle = clients[client].first_subscription; handle != NO_ENTRY; handle = subscriptions[handle].next_in_client) {
+        if (strncmp(subscriptions[handle].source_id, source_id, sizeof(subscriptions[handle].source_id)) == 0) {
+            return static_cast<int32_t>(handle);
+        }
+    }
+    return -1;
+}
+
+bool valid_view(View& view) {  // Normalizes view so equal views compare equal; false if it can't be served
+    if (view.decimation == 1) {
+        view.decimation = 0;
+    }
+    return (view.decimation == 0 || view.window_ms == 0) && view.window_ms <= MAX_WINDOW_MS;
+}
+
+bool attach_view(uint32_t handle, const View& view) {  // Called with client_mutex held; false if the source has no room for another view
+    Subscription& subscription = subscriptions[handle];
+    std::vector<SourceView>& views = source_views[subscription.source - 1];
+    size_t index = views.size();
+    size_t free = views.size();
+    for (size_t k = 0; k < views.size(); k++) {
+        if (views[k].active && views[k].view == view) {
+            index = k;
+            break;
+        }
+        if (!views[k].active && free == views.size()) {
+            free = k;
+        }
+    }
+    if (index == views.size()) {  // First subscriber of this view
+        index = free;
+        if (index == MAX_VIEWS_PER_SOURCE) {
+            admission_rejected++;
+            return false;
+        }
+        if (index == views.size()) {
+            views.reserve(MAX_VIEWS_PER_SOURCE);  // Once per source, so later views never move the others
+            views.emplace_back();
+        }
+        SourceView& source_view = views[index];
+        source_view.active = true;
+        source_view.view = view;
+        source_view.seen = 0;
+        source_view.window = -1;
+        source_view.sum = 0;
+        source_view.aggregate = {};
+        source_view.first_subscription = NO_ENTRY;
+        source_view.n_subscriptions = 0;
+    }
+    SourceView& source_view = views[index];
+    subscription.view = index;
+    subscription.prev_in_view = NO_ENTRY;
+    subscription.next_in_view = source_view.first_subscription;
+    if (source_view.first_subscription != NO_ENTRY) {
+        subscriptions[source_view.first_subscription].prev_in_view = handle;
+    }
+    source_view.first_subscription = handle;
+    source_view.n_subscriptions++;
+    return true;
+}
+
+void detach_view(uint32_t handle) {  // Called with client_mutex held
+    Subscription& subscription = subscriptions[handle];
+    SourceView& view = source_views[subscription.source - 1][subscription.view];
+    if (subscription.prev_in_view != NO_ENTRY) {
+        subscriptions[subscription.prev_in_view].next_in_view = subscription.next_in_view;
+    } else {
+        view.first_subscription = subscription.next_in_view;
+    }
+    if (subscription.next_in_view != NO_ENTRY) {
+        subscriptions[subscription.next_in_view].prev_in_view = subscription.prev_in_view;
+    }
+    if (--view.n_subscriptions == 0) {
+        view.active = false;
+    }
+}
+
+bool view_sample(SourceView& view, const PDU_1& sample, PDU_2& pdu) {
+    // Feeds a sample to the view; true if the view has a PDU for its subscribers, written into pdu
+    if (view.view.window_ms == 0) {
+        pdu.pdu = sample;
+        pdu.aggregate = {};
+        return view.view.decimation == 0 || view.seen++ % view.view.decimation == 0;
+    }
+    // Windows are aligned on the sample clock, so views of the same size agree across sources
+    int64_t window = std::chrono::duration_cast<std::chrono::milliseconds>(sample.timestamp.time_since_epoch()).count() / view.view.window_ms;
+    bool closed = false;
+    if (window > view.window) {
+        if (view.aggregate.samples > 0) {  // The window before is complete: deliver its summary
+            pdu.pdu = view.last;
+            pdu.aggregate = view.aggregate;
+            pdu.aggregate.avg = view.sum / view.aggregate.samples;
+            closed = true;
+        }
+        view.window = window;
+        view.sum = 0;
+        view.aggregate = {sample.value, sample.value, 0, 0};
+    }
+    view.aggregate.min = std::min(view.aggregate.min, sample.value);
+    view.aggregate.max = std::max(view.aggregate.max, sample.value);
+    view.aggregate.samples++;
+    view.sum += sample.value;
+    view.last = sample;
+    return closed;
+}
+
+int32_t add_subscription(uint32_t client, uint32_t source, const char* source_id, int credits, const View& view) {
+    // Called with client_mutex held; -1 if there is no room for another subscription (or view of the source)
+    uint32_t handle = subscriptions.take();
+    if (handle == NO_ENTRY) {
+        admission_rejected++;
+        return -1;
+    }
+    Subscription& subscription = subscriptions[handle];
+    subscription = {};
+    subscription.client = client;
+    subscription.source = source;
+    if (!attach_view(handle, view)) {
+        subscriptions.give(handle);
+        return -1;
+    }
+    subscription.active = true;
+    memcpy(subscription.source_id, source_id, strnlen(source_id, sizeof(subscription.source_id) - 1));
+    subscription.credits = credits;
+    ClientEntry& entry = clients[client];
+    subscription.prev_in_client = NO_ENTRY;
+    subscription.next_in_client = entry.first_subscription;
+    if (entry.first_subscription != NO_ENTRY) {
+        subscriptions[entry.first_subscription].prev_in_client = handle;
+    }
+    entry.first_subscription = handle;
+    entry.n_subscriptions++;
+    n_subscriptions++;
+    trace(TRACE_SUBSCRIBER_ADDED, handle, static_cast<uint64_t>(client) << 32 | source);
+    return handle;
+}
+
+void remove_subscription(uint32_t handle) {  // Called with client_mutex held; drops the client with its last subscription
+    Subscription& subscription = subscriptions[handle];
+    ClientEntry& client = clients[subscription.client];
+    trace(TRACE_SUBSCRIBER_REMOVED, handle, static_cast<uint64_t>(subscription.client) << 32 | subscription.source);
+    if (subscription.prev_in_client != NO_ENTRY) {
+        subscriptions[subscription.prev_in_client].next_in_client = subscription.next_in_client;
+    } else {
+        client.first_subscription = subscription.next_in_client;
+    }
+    if (subscription.next_in_client != NO_ENTRY) {
+        subscriptions[subscription.next_in_client].prev_in_client = subscription.prev_in_client;
+    }
+    detach_view(handle);
+    if (--client.n_subscriptions == 0) {
+        remove_client(subscription.client);
+    }
+    subscription.active = false;
+    subscriptions.give(handle);
+    n_subscriptions--;
+}
 
-            PDU_1 pdu;
-            ssize_t bytes_read = 0;
-            if ((bytes_read = recvfrom(sockfd, &pdu, sizeof(PDU_1), 0, (struct sockaddr*)&clientAddr, &clientAddrLen)) < 0) {
-                std::cerr << "Failed to receive data." << std::endl;
-                close(sockfd);
-                return;
+EgressResult enqueue_egress(const std::shared_ptr<EgressQueue>& queue, uint32_t subscription, const PDU_2& pdu) {
+    // Never blocks on the network: a full queue is resolved by the slow consumer policy
+    auto lock = traced_lock(queue->mutex, LOCK_EGRESS);
+    if (queue->disconnect.load()) {
+        return REFUSED;
+    }
+    size_t depth = queue->items.size();
+    if (egress_config.policy == COALESCE && queue->count == depth) {  // Only a full queue gives up older samples
+        for (size_t k = 0; k < queue->count; k++) {
+            EgressItem& item = queue->items[(queue->head + k) % depth];
+            if (item.subscription == subscription) {
+                item.pdu = pdu;  // The client only ever sees the latest sample of a source
+                egress_coalesced++;
+                return COALESCED;
             }
-            std::string key(pdu.identifier, strlen(pdu.identifier));
-            {
-                std::lock_guard<std::mutex> lock(sources_mutex);
-                sources_map[key] = pdu;
+        }
+    }
+    if (queue->count == depth) {
+        if (egress_config.policy == DISCONNECT) {
+            queue->disconnect.store(true);
+            queue->count = 0;
+            egress_disconnected++;
+            return REFUSED;
+        }
+        queue->head = (queue->head + 1) % depth;
+        queue->count--;
+        egress_dropped++;
+    }
+    EgressItem& item = queue->items[(queue->head + queue->count) % depth];
+    item.subscription = subscription;
+    item.pdu = pdu;
+    queue->count++;
+    EgressLane& lane = *egress_lanes[queue->lane];
+    if (!queue->scheduled) {
+        queue->scheduled = true;
+        std::lock_guard<std::mutex> ready_lock(lane.mutex);
+        lane.ready.push_back(queue);
+    }
+    lane.woken.store(true, std::memory_order_relaxed);  // The fan-out wakes the lane up at the end of its pass
+    return QUEUED;
+}
+
+struct EgressBatch {
+    PDU_2 pdus[IO_BATCH];                           // PDUs retirados das filas e ainda por enviar
+    struct sockaddr_in addrs[IO_BATCH];             // destino de cada PDU
+    std::shared_ptr<EgressQueue> queues[IO_BATCH];  // fila de origem (para contar erros)
+    struct iovec iovs[IO_BATCH];
+    struct mmsghdr msgs[IO_BATCH];
+    size_t count = 0;                               // PDUs no lote
+    size_t next = 0;                                // primeiro PDU ainda não enviado
+};
+
+void init_batch(EgressBatch& batch) {
+    memset(batch.msgs, 0, sizeof(batch.msgs));
+    for (int k = 0; k < IO_BATCH; k++) {
+        batch.iovs[k].iov_base = &batch.pdus[k];
+        batch.iovs[k].iov_len = sizeof(PDU_2);
+        batch.msgs[k].msg_hdr.msg_name = &batch.addrs[k];
+        batch.msgs[k].msg_hdr.msg_namelen = sizeof(batch.addrs[k]);
+        batch.msgs[k].msg_hdr.msg_iov = &batch.iovs[k];
+        batch.msgs[k].msg_hdr.msg_iovlen = 1;
+    }
+    batch.count = 0;
+    batch.next = 0;
+}
+
+void count_send_result(EgressQueue& queue, bool failed) {
+    if (!failed) {
+        egress_sent++;
+        queue.errors.store(0);
+        return;
+    }
+    egress_errors++;
+    if (++queue.errors >= egress_config.max_errors && egress_config.policy == DISCONNECT && !queue.disconnect.exchange(true)) {
+        egress_disconnected++;
+    }
+}
+
+void finish_batch(EgressBatch& batch) {
+    for (size_t k = 0; k < batch.count; k++) {
+        batch.queues[k].reset();
+    }
+    batch.count = 0;
+    batch.next = 0;
+}
+
+void send_batch_socket(int sockfd, EgressBatch& batch, bool& blocked) {
+    // sendmmsg stops at the first failing message: count it and carry on after it
+    while (batch.next < batch.count) {
+        int n = sendmmsg(sockfd, &batch.msgs[batch.next], batch.count - batch.next, MSG_DONTWAIT);
+        if (n > 0) {
+            for (int k = 0; k < n; k++) {
+                count_send_result(*batch.queues[batch.next + k], false);
+            }
+            batch.next += n;
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            egress_eagain++;
+            blocked = true;  // The socket buffer is full: the rest waits for EPOLLOUT
+            return;
+        } else if (errno != EINTR) {
+            count_send_result(*batch.queues[batch.next], true);
+            batch.next++;
+        }
+    }
+    finish_batch(batch);
+}
+
+#ifdef SM_HAVE_IO_URING
+bool send_batch_uring(Uring& ring, int sockfd, EgressBatch& batch) {
+    /* One sendmsg SQE per PDU, submitted together. They are not linked: a failed send to one
+       client would cancel the rest of the chain. false if the ring fails: the caller sends what is
+       left of the batch with plain sockets from then on */
+    size_t queued = 0;
+    for (size_t k = batch.next; k < batch.count; k++) {
+        struct io_uring_sqe* sqe = uring_get_sqe(ring);
+        if (sqe == nullptr) {
+            break;
+        }
+        uring_prep_sendmsg(sqe, sockfd, &batch.msgs[k].msg_hdr, k);
+        queued++;
+    }
+    if (uring_submit(ring, queued) < 0) {  // Nothing was submitted: the batch is still whole
+        std::cerr << "Failed to submit io_uring sends (" << strerror(errno) << "), using plain sockets." << std::endl;
+        return false;
+    }
+    bool completed[IO_BATCH] = {};
+    size_t done = 0;
+    struct io_uring_cqe* cqe;
+    while (done < queued) {
+        while ((cqe = uring_peek_cqe(ring)) == nullptr) {
+            if (uring_submit(ring, 1) < 0) {
+                break;
+            }
+        }
+        if (cqe == nullptr) {
+            break;
+        }
+        if (cqe->res == -EAGAIN) {
+            egress_eagain++;
+        }
+        count_send_result(*batch.queues[cqe->user_data], cqe->res < 0);
+        completed[cqe->user_data] = true;
+        uring_cqe_seen(ring);
+        done++;
+    }
+    bool failed = done < queued;
+    if (failed) {  // Sends whose completion never came are counted as failed
+        std::cerr << "Failed to wait for io_uring sends (" << strerror(errno) << "), using plain sockets." << std::endl;
+        for (size_t k = batch.next; k < batch.next + queued; k++) {
+            if (!completed[k]) {
+                count_send_result(*batch.queues[k], true);
+            }
+        }
+    }
+    batch.next += queued;
+    if (batch.next == batch.count) {
+        finish_batch(batch);
+    }
+    return !failed;
+}
+#endif
+
+bool fill_batch(EgressQueue& queue, const std::shared_ptr<EgressQueue>& owner, EgressBatch& batch, std::chrono::steady_clock::time_point now) {
+    // Moves what the token bucket allows into the batch; returns true if PDUs are left in the queue
+    auto lock = traced_lock(queue.mutex, LOCK_EGRESS);
+    if (queue.closed.load() || queue.disconnect.load()) {
+        queue.count = 0;
+    }
+    if (egress_config.rate > 0) {
+        double elapsed = std::chrono::duration<double>(now - queue.last_refill).count();
+        queue.tokens = std::min(egress_config.burst, queue.tokens + elapsed * egress_config.rate);
+    }
+    queue.last_refill = now;
+    size_t depth = queue.items.size();
+    while (queue.count > 0 && batch.count < IO_BATCH && (egress_config.rate <= 0 || queue.tokens >= 1)) {
+        batch.pdus[batch.count] = queue.items[queue.head].pdu;
+        batch.addrs[batch.count] = queue.clientAddr;
+        batch.queues[batch.count] = owner;
+        batch.count++;
+        queue.head = (queue.head + 1) % depth;
+        queue.count--;
+        queue.tokens -= 1;
+    }
+    if (queue.count == 0) {
+        queue.scheduled = false;
+        return false;
+    }
+    return true;
+}
+
+void flush_egress(EgressLane& lane, int sockfd) {
+    try { /*  Drain the client queues of a lane in batches of non-blocking sends, pacing each client with its
+              token bucket. When the socket buffer fills up, wait for EPOLLOUT instead of blocking */
+        start_thread("egress", ROLE_FANOUT);
+        int epfd = epoll_create1(0);
+        if (epfd == -1) {
+            std::cerr << "Failed to create epoll instance." << std::endl;
+            return;
+        }
+        struct epoll_event event = {};
+        event.events = EPOLLIN;
+        event.data.fd = lane.event;
+        epoll_ctl(epfd, EPOLL_CTL_ADD, lane.event, &event);
+        event.events = 0;  // EPOLLOUT is only armed while the socket is full
+        event.data.fd = sockfd;
+        epoll_ctl(epfd, EPOLL_CTL_ADD, sockfd, &event);
+
+#ifdef SM_HAVE_IO_URING
+        Uring ring;
+        bool use_uring = io_backend == IO_URING && uring_init(ring, 2 * IO_BATCH);
+        bool uring_failed = false;
+#endif
+        std::unique_ptr<EgressBatch> batch(new EgressBatch());
+        init_batch(*batch);
+        auto send_batch = [&](bool& blocked) {
+#ifdef SM_HAVE_IO_URING
+            if (use_uring && !uring_failed) {
+                if (send_batch_uring(ring, sockfd, *batch)) {
+                    return;
+                }
+                uring_failed = true;
+            }
+#endif
+            send_batch_socket(sockfd, *batch, blocked);
+        };
+
+        std::vector<std::shared_ptr<EgressQueue>> active;
+        std::vector<std::shared_ptr<EgressQueue>> waiting;
+        active.reserve(egress_pool.size());  // A lane never holds more queues than there are
+        waiting.reserve(egress_pool.size());
+        struct epoll_event events[2];
+        bool blocked = false;
+        int timeout = 100;
+
+        thread_warmed_up();
+        while (keep_running.load()) {
+            int n_events = epoll_wait(epfd, events, 2, timeout);
+            for (int k = 0; k < n_events; k++) {
+                if (events[k].data.fd == lane.event) {
+                    uint64_t wakeups;
+                    if (read(lane.event, &wakeups, sizeof(wakeups)) == -1 && errno != EAGAIN) {
+                        std::cerr << "Failed to read egress event." << std::endl;
+                    }
+                } else if (events[k].events & EPOLLOUT) {
+                    blocked = false;
+                    event.events = 0;
+                    event.data.fd = sockfd;
+                    epoll_ctl(epfd, EPOLL_CTL_MOD, sockfd, &event);
+                }
+            }
+            {
+                std::lock_guard<std::mutex> lock(lane.mutex);
+                active.insert(active.end(), lane.ready.begin(), lane.ready.end());
+                lane.ready.clear();
+            }
+            timeout = 100;
+            if (blocked) {
+                continue;
+            }
+            if (batch->count > 0) {
+                send_batch(blocked);  // What was left when the socket filled up goes first
+            }
+            auto now = std::chrono::steady_clock::now();
+            waiting.clear();
+            for (size_t k = 0; k < active.size(); k++) {
+                bool leftover = true;
+                while (!blocked) {
+                    leftover = fill_batch(*active[k], active[k], *batch, now);
+                    if (batch->count < IO_BATCH) {
+                        break;
+                    }
+                    send_batch(blocked);
+                    if (!leftover) {
+                        break;
+                    }
+                }
+                if (leftover) {
+                    waiting.push_back(active[k]);
+                }
+            }
+            if (!blocked && batch->count > 0) {
+                send_batch(blocked);
+            }
+            active.swap(waiting);
+            if (blocked) {
+                event.events = EPOLLOUT;
+                event.data.fd = sockfd;
+                epoll_ctl(epfd, EPOLL_CTL_MOD, sockfd, &event);
+            } else if (!active.empty()) {
+                // Only paced queues are left: come back when they earn their next token
+                timeout = std::max(1, static_cast<int>(1000 / std::max(egress_config.rate, 1.0)));
+            }
+        }
+#ifdef SM_HAVE_IO_URING
+        if (use_uring) {
+            uring_exit(ring);
+        }
+#endif
+        close(epfd);
+    } catch (const std::exception& e) {
+        std::cerr << "Exception in flush_egress: " << e.what() << std::endl;
+        keep_running.store(false);
+        cv.notify_all();
+    }
+}
+
+bool filter_passes(const Subscription& subscription, int value, std::chrono::steady_clock::time_point now) {
+    const Filter& filter = subscription.filter;
+    if (filter.deadband == 0 || !subscription.delivered) {
+        return true;
+    }
+    if (std::abs(static_cast<int64_t>(value) - subscription.last_value) >= filter.deadband) {
+        return true;
+    }
+    return filter.heartbeat_ms > 0 && now - subscription.last_delivery >= std::chrono::milliseconds(filter.heartbeat_ms);
+}
+
+uint32_t deliver(SourceView& view, uint32_t source, PDU_2& pdu, std::chrono::steady_clock::time_point now) {
+    /* Queues pdu for every subscriber of the view that has credits and whose filter lets it through;
+       called with sources_mutex and client_mutex held */
+    uint32_t queued = 0;
+    int value = pdu.aggregate.samples > 0 ? static_cast<int>(std::lround(pdu.aggregate.avg)) : pdu.pdu.value;
+    for (uint32_t handle = view.first_subscription; handle != NO_ENTRY; handle = subscriptions[handle].next_in_view) {
+        Subscription& subscription = subscriptions[handle];
+        if (subscription.credits <= 0 || !filter_passes(subscription, value, now)) {
+            continue;
+        }
+        subscription.credits -= 1;
+        fill_subscriber(pdu.sub, subscription);
+        pdu.filter = subscription.filter;
+        EgressResult result = enqueue_egress(clients[subscription.client].egress, handle, pdu);
+        if (result != REFUSED) {  // The client will see this value, so the filter compares against it from now on
+            subscription.delivered = true;
+            subscription.last_value = value;
+            subscription.last_delivery = now;
+        }
+        if (result == QUEUED) {
+            queued++;
+            if (subscription.credits == 0) {
+                trace(TRACE_CREDITS_EXHAUSTED, handle, source);
+            }
+        } else {
+            subscription.credits += 1;  // Only samples that may still reach the client cost a credit
+        }
+    }
+    return queued;
+}
+
+uint32_t fan_out(const std::vector<uint32_t>& sources, std::chrono::steady_clock::time_point now) {
+    /* Runs the views of each source with a sample waiting and queues their PDUs for the subscribers;
+       called with sources_mutex and client_mutex held. Returns the PDUs queued */
+    PDU_2 pdu = {};
+    char type[] = "data";
+    memcpy(pdu.type, type, sizeof(type));
+    uint32_t queued = 0;
+    for (uint32_t source : sources) {
+        SourceSlot& slot = source_slots[source - 1];
+        slot.pending = false;
+        uint32_t queued_before = queued;
+        bool keep_backlog = false;
+        if (source <= source_views.size()) {
+            for (SourceView& view : source_views[source - 1]) {
+                if (!view.active) {
+                    continue;
+                }
+                pdu.view = view.view;
+                if (view.view.decimation == 0 && view.view.window_ms == 0) {  // Plain view: latest sample only
+                    if (view_sample(view, slot.pdu, pdu)) {
+                        queued += deliver(view, source, pdu, now);
+                    }
+                    continue;
+                }
+                keep_backlog = true;
+                for (const PDU_1& sample : slot.backlog) {
+                    if (view_sample(view, sample, pdu)) {
+                        queued += deliver(view, source, pdu, now);
+                    }
+                }
+            }
+        }
+        slot.backlog.clear();
+        if (keep_backlog && !slot.keep_backlog) {
+            slot.backlog.reserve(MAX_BACKLOG);
+        }
+        slot.keep_backlog = keep_backlog;
+        if (queued > queued_before) {
+            slot.pdu.sent = true;
+        }
+    }
+    return queued;
+}
+
+void send_pdu(const std::string ip, int port) {
+    try { /*  Continuously check for new PDUs in the list of processed PDUs
+              Identify subscribed clients for each PDU and queue the PDU for those clients */
+        start_thread("fanout", ROLE_FANOUT);
+        std::vector<int> sockets;  // One per lane, so the egress threads don't share a socket's send path
+        std::vector<std::thread> egress_threads;
+        for (auto& lane : egress_lanes) {
+            int sockfd;
+            struct sockaddr_in serverAddr;
+            create_sender_socket(ip, port, sockfd, serverAddr);
+            fcntl(sockfd, F_SETFL, fcntl(sockfd, F_GETFL) | O_NONBLOCK);
+            sockets.push_back(sockfd);
+            lane->event = eventfd(0, EFD_NONBLOCK);
+            egress_threads.emplace_back(flush_egress, std::ref(*lane), sockfd);
+        }
+        std::vector<uint32_t> fanout_sources;
+        fanout_sources.reserve(capacity_config.max_sources);  // Swapped with dirty_sources, which the ingest path fills without growing
+
+        thread_warmed_up();
+        while (keep_running.load()) {
+            {
+                std::unique_lock<std::mutex> lock(sources_mutex);
+                cv.wait(lock, [] { return (!dirty_sources.empty() && n_subscriptions.load() > 0 && new_notification.load()) || !keep_running.load(); });
+                fanout_sources.swap(dirty_sources);  // Both keep their capacity, so no allocation per wakeup
+                trace(TRACE_FANOUT_START, fanout_sources.size());
+                auto sub_lock = traced_lock(client_mutex, LOCK_CLIENTS);
+                // Heartbeats are checked against one clock read per pass
+                uint32_t queued = fan_out(fanout_sources, std::chrono::steady_clock::now());
+                fanout_sources.clear();
+                sub_lock.unlock();
+                trace(TRACE_FANOUT_END, queued);
+
+                new_notification.store(false);
+                for (auto& lane : egress_lanes) {
+                    if (lane->woken.exchange(false, std::memory_order_relaxed)) {
+                        uint64_t wakeup = 1;
+                        if (write(lane->event, &wakeup, sizeof(wakeup)) == -1) {
+                            std::cerr << "Failed to wake up egress thread." << std::endl;
+                        }
+                    }
+                }
+            }
+        }
+        for (size_t k = 0; k < egress_threads.size(); k++) {
+            egress_threads[k].join();
+            close(egress_lanes[k]->event.exchange(-1));  // stop_threads may still try to wake it
+            close(sockets[k]);
+        }
+    } catch (const std::exception& e) {
+        std::cerr << "Exception in send_pdu: " << e.what() << std::endl;
+        keep_running.store(false);
+        cv.notify_all();
+    }
+}
+
+void send_monitor_data(const std::string ip, int port) {
+    try {
+        int sockfd;
+        struct sockaddr_in monitorAddr;
+        memset(&monitorAddr, 0, sizeof(monitorAddr));
+
+        create_sender_socket(ip, port, sockfd, monitorAddr);
+        start_thread("monitor", ROLE_OTHER);
+
+        size_t previous_sources_size = 0;
+        size_t previous_subscribers_size = 0;
+        uint64_t previous_egress_total = 0;
+        auto last_sent = std::chrono::steady_clock::now();
+
+        while (keep_running.load()) {
+            size_t current_sources_size = 0;
+            size_t current_subscribers_size = 0;
+
+            {
+                auto lock = traced_lock(sources_mutex, LOCK_SOURCES);
+                current_sources_size = n_active_sources.load();
+            }
+            {
+                auto lock = traced_lock(client_mutex, LOCK_CLIENTS);
+                current_subscribers_size = n_subscriptions.load();
+            }
+            PDU_3 pdu_3;
+            pdu_3.egress_sent = egress_sent.load();
+            pdu_3.egress_dropped = egress_dropped.load();
+            pdu_3.egress_coalesced = egress_coalesced.load();
+            pdu_3.egress_disconnected = egress_disconnected.load();
+            pdu_3.egress_eagain = egress_eagain.load();
+            pdu_3.egress_errors = egress_errors.load();
+            pdu_3.admission_rejected = admission_rejected.load();
+            pdu_3.requests_dropped = requests_dropped.load();
+            pdu_3.allocations = allocations.load();
+            pdu_3.data_path_allocations = data_path_allocations();
+            uint64_t egress_total = pdu_3.egress_sent + pdu_3.egress_dropped + pdu_3.egress_coalesced + pdu_3.egress_disconnected +
+                                    pdu_3.egress_eagain + pdu_3.egress_errors + pdu_3.admission_rejected + pdu_3.requests_dropped +
+                                    pdu_3.data_path_allocations;
+            bool counters_due = egress_total != previous_egress_total && std::chrono::steady_clock::now() - last_sent > std::chrono::seconds(1);
+            if (current_sources_size != previous_sources_size || current_subscribers_size != previous_subscribers_size || counters_due) {
+                pdu_3.n_sources = current_sources_size;
+                pdu_3.n_subscribers = current_subscribers_size;
+
+                ssize_t bytes_sent = sendto(sockfd, &pdu_3, sizeof(pdu_3), 0, (struct sockaddr*)&monitorAddr, sizeof(monitorAddr));
+                if (bytes_sent == -1) {
+                    std::cerr << "Failed to send PDU_3 to monitor." << std::endl;
+                }
+                previous_sources_size = current_sources_size;
+                previous_subscribers_size = current_subscribers_size;
+                previous_egress_total = egress_total;
+                last_sent = std::chrono::steady_clock::now();
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+        close(sockfd);
+    } catch (const std::exception& e) {
+        std::cerr << "Exception in send_monitor_data thread: " << e.what() << std::endl;
+        keep_running.store(false);
+        cv.notify_all();
+    }
+}
+
+void get_sources_list(PDU_2& pdu_2) {  // Gets the first active sources that fit in pdu_2, separated by spaces
+    size_t i = 0;
+    size_t size = sizeof(pdu_2.active_sources) - 1;
+    {
+        auto lock = traced_lock(catalog_mutex, LOCK_CATALOG);
+        for (uint32_t entry = catalog_sources.first(); entry != NO_ENTRY; entry = catalog_sources.next(entry)) {
+            const CatalogSource& source = catalog_sources[entry];
+            size_t length = strnlen(source.identifier, sizeof(source.identifier));
+            size_t needed = length + (i > 0 ? 1 : 0);
+            if (i + needed > size) {
+                break;  // Ensuring we don't exceed the size of active_sources array
+            }
+            if (i > 0) {
+                pdu_2.active_sources[i++] = ' ';
+            }
+            memcpy(pdu_2.active_sources + i, source.identifier, length);
+            i += length;
+        }
+    }
+    pdu_2.active_sources[i] = '\0';
+}
+
+void get_catalog_page(PDU_4& pdu_4) {  // Fills pdu_4 with the sources that follow pdu_4.cursor
+    char cursor[10];
+    catalog_key(pdu_4.cursor, cursor);
+    pdu_4.count = 0;
+    pdu_4.more = 0;
+    pdu_4.reset = 0;
+    auto lock = traced_lock(catalog_mutex, LOCK_CATALOG);
+    pdu_4.version = catalog_version;
+    uint32_t it = catalog_position(cursor);
+    if (catalog_lists(it, cursor)) {
+        it = catalog_sources.next(it);  // The cursor itself was on the previous page
+    }
+    for (; it != NO_ENTRY; it = catalog_sources.next(it)) {
+        if (pdu_4.count == CATALOG_PAGE_SIZE) {
+            pdu_4.more = 1;
+            break;
+        }
+        CatalogEntry& entry = pdu_4.entries[pdu_4.count++];
+        entry = {};
+        memcpy(entry.identifier, catalog_sources[it].identifier, sizeof(entry.identifier));
+        entry.removed = 0;
+    }
+    pdu_4.cursor[0] = '\0';
+    if (pdu_4.count > 0) {
+        memcpy(pdu_4.cursor, pdu_4.entries[pdu_4.count - 1].identifier, sizeof(pdu_4.cursor));
+    }
+}
+
+void get_catalog_changes(PDU_4& pdu_4) {  // Fills pdu_4 with the changes made after pdu_4.version
+    uint64_t since = pdu_4.version;
+    pdu_4.count = 0;
+    pdu_4.more = 0;
+    pdu_4.reset = 0;
+    auto lock = traced_lock(catalog_mutex, LOCK_CATALOG);
+    if (since >= catalog_version) {
+        pdu_4.version = catalog_version;
+        return;
+    }
+    const CatalogChange& oldest = catalog_changes[catalog_changes_head];
+    if (catalog_changes_count == 0 || since + 1 < oldest.version) {
+        pdu_4.reset = 1;  // The changes the client missed were already forgotten
+        pdu_4.version = catalog_version;
+        return;
+    }
+    size_t first = since + 1 - oldest.version;  // catalog_changes[head + k].version == oldest.version + k
+    for (size_t k = first; k < catalog_changes_count; k++) {
+        if (pdu_4.count == CATALOG_PAGE_SIZE) {
+            pdu_4.more = 1;
+            break;
+        }
+        const CatalogChange& change = catalog_changes[(catalog_changes_head + k) % MAX_CATALOG_CHANGES];
+        CatalogEntry& entry = pdu_4.entries[pdu_4.count++];
+        entry = {};
+        memcpy(entry.identifier, change.identifier, sizeof(entry.identifier));
+        entry.removed = change.removed ? 1 : 0;
+        pdu_4.version = change.version;
+    }
+}
+
+void process_catalog_request(PDU_4 pdu_4, const struct sockaddr_in& clientAddr, int sockfd) {
+    switch (pdu_4.id) {
+        case 7:  // Page through the catalog
+            get_catalog_page(pdu_4);
+            break;
+        case 8:  // Changes since a catalog version
+            get_catalog_changes(pdu_4);
+            break;
+    }
+    if (sendto(sockfd, &pdu_4, sizeof(pdu_4), 0, (struct sockaddr*)&clientAddr, sizeof(clientAddr)) == -1) {
+        std::cerr << "Failed to send response to client." << std::endl;
+    }
+}
+
+void send_ack(PDU_2& pdu_2, int sockfd, const std::string type = "ack") {
+    size_t length = strlen(type.c_str());
+    size_t max_size = sizeof(pdu_2.type);
+    size_t bytes_sent;
+    pdu_2.id = 5;
+    if (length < max_size) {
+        memcpy(pdu_2.type, type.c_str(), length);
+        pdu_2.type[length] = '\0';
+    } else {
+        std::cerr << "Length of type bigger than allowed." << std::endl;
+    }
+
+    if ((bytes_sent = sendto(sockfd, &pdu_2, sizeof(pdu_2), 0, (struct sockaddr*)&pdu_2.sub.clientAddr, sizeof(pdu_2.sub.clientAddr))) < 0) {
+        std::cerr << "Failed to send response to client." << std::endl;
+    }
+}
+
+void process_request(PDU_2 pdu_2, int sockfd, int credits) {  // Process user requests
+    ssize_t bytes_sent = 0;
+    PDU_1 pdu;
+    switch (pdu_2.id) {
+        case 1:  // List sources
+            // Looks up for sources available
+            get_sources_list(pdu_2);
+            bytes_sent = sendto(sockfd, &pdu_2, sizeof(pdu_2), 0, (struct sockaddr*)&pdu_2.sub.clientAddr, sizeof(pdu_2.sub.clientAddr));
+            if (bytes_sent == -1) {
+                std::cerr << "Failed to send response to client." << std::endl;
+            }
+            break;
+        case 2:  // Get source info
+            // Looks up for info about the required source
+            pdu = {};
+            {
+                auto lock = traced_lock(sources_mutex, LOCK_SOURCES);
+                int32_t source = find_source(pdu_2.pdu.identifier);
+                if (source > 0 && source_slots[source - 1].active) {
+                    pdu = source_slots[source - 1].pdu;
+                }
+            }
+            pdu_2.pdu = pdu;
+
+            bytes_sent = sendto(sockfd, &pdu_2, sizeof(pdu_2), 0, (struct sockaddr*)&pdu_2.sub.clientAddr, sizeof(pdu_2.sub.clientAddr));
+            if (bytes_sent == -1) {
+                std::cerr << "Failed to send response to client." << std::endl;
+            }
+            break;
+        case 3:  // Play from source
+            // Adds (or refills) the subscription of this client to the source and notifies sender thread.
+            // pdu_2.view may ask for every k-th sample or for min/max/avg per window instead of every sample,
+            // and pdu_2.filter for only the samples that moved by a deadband (with an optional heartbeat)
+            {
+                auto source_lock = traced_lock(sources_mutex, LOCK_SOURCES);
+                int32_t source = find_source(pdu_2.sub.source_id);
+                bool available = source > 0 && source_slots[source - 1].active;
+                if (!available && offered_upstream(pdu_2.sub.source_id)) {
+                    source = intern_source(pdu_2.sub.source_id);  // The relay thread subscribes upstream once it sees the subscription
+                    available = source > 0;
+                }
+                if (available && valid_view(pdu_2.view)) {
+                    SourceSlot& slot = source_slots[source - 1];
+                    if (pdu_2.view.decimation > 0 || pdu_2.view.window_ms > 0) {
+                        if (slot.backlog.capacity() < MAX_BACKLOG) {
+                            slot.backlog.reserve(MAX_BACKLOG);  // Here rather than in the fan-out, which never allocates
+                        }
+                        slot.keep_backlog = true;  // The view needs every sample from now on, not from the next fan-out pass
+                    }
+                    source_lock.unlock();
+                    auto sub_lock = traced_lock(client_mutex, LOCK_CLIENTS);
+                    int32_t client = find_client(pdu_2.sub);
+                    bool added = client < 0;
+                    if (added) {
+                        client = add_client(pdu_2.sub);
+                    }
+                    int32_t subscription = client < 0 ? -1 : find_subscription(client, pdu_2.sub.source_id);
+                    if (subscription >= 0) {
+                        subscriptions[subscription].credits = credits;
+                        subscriptions[subscription].filter = pdu_2.filter;
+                        const View& current = source_views[source - 1][subscriptions[subscription].view].view;
+                        if (!(current == pdu_2.view)) {  // Playing again with another view switches to it, if there is room for it
+                            View previous = current;
+                            detach_view(subscription);
+                            if (!attach_view(subscription, pdu_2.view)) {
+                                attach_view(subscription, previous);  // Never fails: the view just left is active or free
+                                subscription = -1;
+                            }
+                        }
+                    } else if (client >= 0) {
+                        subscription = add_subscription(client, source, pdu_2.sub.source_id, credits, pdu_2.view);
+                        if (subscription >= 0) {
+                            subscriptions[subscription].filter = pdu_2.filter;
+                        } else if (added) {
+                            remove_client(client);
+                        }
+                    }
+                    if (subscription >= 0) {
+                        fill_subscriber(pdu_2.sub, subscriptions[subscription]);
+                    }
+                    sub_lock.unlock();
+                    send_ack(pdu_2, sockfd, subscription >= 0 ? "ack" : "nack");  // nack: no room for the client, subscription or view
+                    cv.notify_one();
+                } else {
+                    source_lock.unlock();
+                    send_ack(pdu_2, sockfd, "nack");
+                }
+            }
+            break;
+        case 4:  // Stop playing from source
+            // Removes the subscription to the source (or every subscription of the client if none is given)
+            {
+                auto lock = traced_lock(client_mutex, LOCK_CLIENTS);
+                int32_t client = find_client(pdu_2.sub);
+                bool removed = false;
+                uint32_t handle = client >= 0 ? clients[client].first_subscription : NO_ENTRY;
+                while (handle != NO_ENTRY) {
+                    uint32_t next = subscriptions[handle].next_in_client;  // Read before the subscription (and maybe the client) goes
+                    if (pdu_2.pdu.identifier[0] == '\0' ||
+                        strncmp(subscriptions[handle].source_id, pdu_2.pdu.identifier, sizeof(pdu_2.pdu.identifier)) == 0) {
+                        remove_subscription(handle);
+                        removed = true;
+                    }
+                    handle = next;
+                }
+                lock.unlock();
+                send_ack(pdu_2, sockfd, removed ? "ack" : "nack");
+            }
+            break;
+        case 6:
+            // Get subscribed sources, a page at a time after the source in pdu_2.pdu.identifier
+            {
+                PDU_4 pdu_4 = {};
+                pdu_4.id = 6;
+                pdu_4.req_id = pdu_2.req_id;
+                memcpy(pdu_4.client_id, pdu_2.sub.client_id, sizeof(pdu_4.client_id) - 1);
+                // The page is kept sorted as the client's sources are visited, one more than fits to tell if there are more
+                const size_t id_size = sizeof(Subscription::source_id);
+                char page[CATALOG_PAGE_SIZE + 1][id_size];
+                size_t n = 0;
+                {
+                    auto lock = traced_lock(client_mutex, LOCK_CLIENTS);
+                    int32_t client = find_client(pdu_2.sub);
+                    for (uint32_t handle = client >= 0 ? clients[client].first_subscription : NO_ENTRY; handle != NO_ENTRY;
+                         handle = subscriptions[handle].next_in_client) {
+                        const char* source_id = subscriptions[handle].source_id;
+                        if (strncmp(source_id, pdu_2.pdu.identifier, id_size) <= 0) {
+                            continue;  // Up to the cursor: already on an earlier page
+                        }
+                        size_t position = n;
+                        while (position > 0 && strncmp(page[position - 1], source_id, id_size) > 0) {
+                            position--;
+                        }
+                        if (position == CATALOG_PAGE_SIZE + 1) {
+                            continue;
+                        }
+                        size_t kept = std::min(n, static_cast<size_t>(CATALOG_PAGE_SIZE));  // When the page is full, the last one falls off
+                        memmove(page[position + 1], page[position], (kept - position) * id_size);
+                        memcpy(page[position], source_id, id_size);
+                        n = std::min(n + 1, static_cast<size_t>(CATALOG_PAGE_SIZE + 1));
+                    }
+                }
+                pdu_4.more = n > CATALOG_PAGE_SIZE ? 1 : 0;
+                pdu_4.count = std::min(n, static_cast<size_t>(CATALOG_PAGE_SIZE));
+                for (size_t k = 0; k < pdu_4.count; k++) {
+                    memcpy(pdu_4.entries[k].identifier, page[k], id_size);
+                }
+                if (pdu_4.count > 0) {
+                    memcpy(pdu_4.cursor, page[pdu_4.count - 1], id_size);
+                }
+                bytes_sent = sendto(sockfd, &pdu_4, sizeof(pdu_4), 0, (struct sockaddr*)&pdu_2.sub.clientAddr, sizeof(pdu_2.sub.clientAddr));
+                if (bytes_sent == -1) {
+                    std::cerr << "Failed to send response to client." << std::endl;
+                }
+            }
+            break;
+        case 10:  // Replay a recorded time range (answered by the replay thread)
+            {
+                std::lock_guard<std::mutex> lock(replay_mutex);
+                replay_requests.push_back(pdu_2);
+            }
+            replay_cv.notify_one();
+            break;
+        case 9:  // Dump the flight recorder
+            send_ack(pdu_2, sockfd, trace_dump(trace_path) ? "ack" : "nack");
+            break;
+        default:
+            std::cerr << "Invalid request from client." << std::endl;
+    }
+}
+
+void request_worker(RequestQueue& queue, int sockfd, int credits) {
+    try { /*  Take requests from the worker's queue and answer them, in the order each client sent them.
+              Several workers run at once, so replies to different clients may leave out of order */
+        start_thread("worker", ROLE_CONTROL);
+        while (true) {
+            Request request;
+            {
+                std::unique_lock<std::mutex> lock(request_mutex);
+                queue.cv.wait(lock, [&] { return queue.count > 0 || !keep_running.load(); });
+                if (queue.count == 0) {
+                    break;
+                }
+                request = queue.requests[queue.head];
+                queue.head = (queue.head + 1) % queue.requests.size();
+                queue.count--;
+            }
+            if (request.pdu_2.id == 7 || request.pdu_2.id == 8) {
+                process_catalog_request(request.pdu_4, request.pdu_2.sub.clientAddr, sockfd);
+            } else {
+                process_request(request.pdu_2, sockfd, credits);
+            }
+        }
+    } catch (const std::exception& e) {
+        std::cerr << "Exception in request_worker: " << e.what() << std::endl;
+        keep_running.store(false);
+        cv.notify_all();
+        wake_request_workers();
+    }
+}
+
+bool decode_request(const char* buffer, size_t length, const struct sockaddr_in& clientAddr, Request& request) {
+    // false if the datagram is too short to be a request
+    request = {};
+    int id;
+    if (length < sizeof(id)) {
+        return false;
+    }
+    memcpy(&id, buffer, sizeof(id));  // Every request starts with its command id
+    if (id == 7 || id == 8) {
+        memcpy(&request.pdu_4, buffer, std::min(length, sizeof(PDU_4)));
+        request.pdu_2.id = id;
+        memcpy(request.pdu_2.sub.client_id, request.pdu_4.client_id, sizeof(request.pdu_2.sub.client_id));  // Picks the worker
+    } else {
+        memcpy(&request.pdu_2, buffer, std::min(length, sizeof(PDU_2)));
+    }
+    memcpy(&request.pdu_2.sub.clientAddr, &clientAddr, sizeof(clientAddr));
+    return true;
+}
+
+void queue_request(const char* buffer, size_t length, const struct sockaddr_in& clientAddr) {
+    Request request;
+    if (!decode_request(buffer, length, clientAddr, request)) {
+        return;
+    }
+    // print_pdu_2(request.pdu_2);
+    RequestQueue& queue = *request_queues[EndpointKeyHash()(endpoint_key(request.pdu_2.sub)) % request_queues.size()];
+    {
+        auto lock = traced_lock(request_mutex, LOCK_REQUESTS);
+        if (queue.count == queue.requests.size()) {
+            requests_dropped++;  // The worker is that far behind: the client times out and asks again
+            return;
+        }
+        queue.requests[(queue.head + queue.count) % queue.requests.size()] = request;
+        queue.count++;
+    }
+    queue.cv.notify_one();
+}
+
+void receive_requests_socket(int sockfd) {  // Receives up to IO_BATCH requests per recvmmsg
+    std::vector<char> buffers(IO_BATCH * REQUEST_SIZE);
+    struct sockaddr_in addrs[IO_BATCH];
+    struct iovec iovs[IO_BATCH];
+    struct mmsghdr msgs[IO_BATCH];
+    memset(msgs, 0, sizeof(msgs));
+    for (int k = 0; k < IO_BATCH; k++) {
+        iovs[k].iov_base = &buffers[k * REQUEST_SIZE];
+        iovs[k].iov_len = REQUEST_SIZE;
+        msgs[k].msg_hdr.msg_name = &addrs[k];
+        msgs[k].msg_hdr.msg_iov = &iovs[k];
+        msgs[k].msg_hdr.msg_iovlen = 1;
+    }
+
+    while (keep_running.load()) {
+        for (int k = 0; k < IO_BATCH; k++) {
+            msgs[k].msg_hdr.msg_namelen = sizeof(addrs[k]);
+        }
+        int n = recvmmsg(sockfd, msgs, IO_BATCH, MSG_WAITFORONE, nullptr);
+        if (n < 0) {
+            if (errno != EINTR && errno != EAGAIN) {
+                std::cerr << "Error receiving client request." << std::endl;
+            }
+            continue;
+        }
+        for (int k = 0; k < n; k++) {
+            queue_request(&buffers[k * REQUEST_SIZE], msgs[k].msg_len, addrs[k]);
+        }
+    }
+}
+
+#ifdef SM_HAVE_IO_URING
+bool receive_requests_uring(int sockfd) {  // Multishot recvmsg into provided buffers; false if the ring can't be set up or fails
+    Uring ring;
+    UringBufRing buffers;
+    if (!uring_init(ring, 64)) {
+        return false;
+    }
+    if (!uring_setup_buf_ring(ring, buffers, 0, 64, 1024)) {
+        uring_exit(ring);
+        return false;
+    }
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_namelen = sizeof(struct sockaddr_in);
+    bool armed = false;
+    bool failed = false;
+
+    while (keep_running.load()) {
+        if (!armed) {
+            uring_prep_recvmsg_multishot(uring_get_sqe(ring), sockfd, &msg, buffers.bgid, 0);
+            armed = true;
+        }
+        if (uring_submit(ring, 1) < 0) {  // The caller goes on with plain sockets rather than leave the port unread
+            std::cerr << "Failed to wait for io_uring completions (" << strerror(errno) << "), using plain sockets." << std::endl;
+            failed = true;
+            break;
+        }
+        struct io_uring_cqe* cqe;
+        while ((cqe = uring_peek_cqe(ring)) != nullptr) {
+            if (cqe->res >= 0 && (cqe->flags & IORING_CQE_F_BUFFER)) {
+                struct sockaddr_in addr;
+                char* payload;
+                size_t length;
+                if (uring_recvmsg_payload(buffers, cqe, msg, addr, payload, length)) {
+                    queue_request(payload, length, addr);
+                }
+                uring_recycle_buffer(buffers, cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+            } else if (cqe->res < 0 && cqe->res != -ENOBUFS) {
+                std::cerr << "Error receiving client request: " << strerror(-cqe->res) << std::endl;
+            }
+            if (!(cqe->flags & IORING_CQE_F_MORE)) {
+                armed = false;
+            }
+            uring_cqe_seen(ring);
+        }
+    }
+    uring_free_buf_ring(buffers);
+    uring_exit(ring);
+    return !failed;
+}
+#endif
+
+std::string segment_path(const std::string& identifier, uint64_t first_seq, int attempt) {
+    std::string name = identifier;
+    bool sanitized = false;
+    for (char& c : name) {
+        if (!isalnum(static_cast<unsigned char>(c)) && c != '-' && c != '_') {
+            c = '_';  // The header keeps the real identifier
+            sanitized = true;
+        }
+    }
+    if (sanitized) {  // Identifiers that only differ in the replaced characters would share the name
+        char hash[10];
+        snprintf(hash, sizeof(hash), ".%08x", static_cast<uint32_t>(hash_bytes(identifier.data(), identifier.length())));
+        name += hash;
+    }
+    if (attempt > 0) {  // A file of another run (or source) already has the name
+        name += "~" + std::to_string(attempt);
+    }
+    return record_config.dir + "/" + name + "-" + std::to_string(first_seq) + ".seg";
+}
+
+void load_recordings() {  // Picks up the segments left by earlier runs, so they can be replayed and expired
+    std::lock_guard<std::mutex> lock(recordings_mutex);
+    for (const auto& entry : std::filesystem::directory_iterator(record_config.dir)) {
+        if (entry.path().extension() != ".seg") {
+            continue;
+        }
+        Segment segment;
+        std::string identifier;
+        if (segment_load(entry.path().string(), segment, identifier)) {
+            recordings[identifier].segments.push_back(segment);
+        } else {
+            std::cerr << "Ignoring unreadable segment " << entry.path() << "." << std::endl;
+        }
+    }
+    for (auto& [identifier, recording] : recordings) {
+        std::sort(recording.segments.begin(), recording.segments.end(), [](const Segment& a, const Segment& b) { return a.first_seq < b.first_seq; });
+        recording.next_seq = recording.segments.back().first_seq + recording.segments.back().count;
+    }
+}
+
+void close_segment(Recording& recording) {  // Called by the recorder thread
+    uint64_t count = recording.writer.header->count;
+    int64_t last_time_ns = recording.writer.header->last_time_ns;
+    uint64_t bytes = segment_close(recording.writer);
+    std::lock_guard<std::mutex> lock(recordings_mutex);
+    Segment& segment = recording.segments.back();
+    if (count == 0) {
+        unlink(segment.path.c_str());
+        recording.segments.pop_back();
+        return;
+    }
+    segment.count = count;
+    segment.last_time_ns = last_time_ns;
+    segment.bytes = bytes;
+}
+
+void record_sample(Recording& recording, const PDU_1& pdu, std::chrono::steady_clock::time_point now) {  // Called by the recorder thread
+    SegmentWriter& writer = recording.writer;
+    if (writer.fd != -1 && (segment_full(writer) || writer.header->frequency != pdu.frequency || writer.header->multiple != pdu.multiple)) {
+        close_segment(recording);  // A segment holds a single rate, so replay can rebuild the samples
+    }
+    if (writer.fd == -1) {
+        if (now < recording.retry_after) {
+            record_dropped++;
+            return;
+        }
+        std::string identifier(pdu.identifier, strnlen(pdu.identifier, sizeof(pdu.identifier)));
+        std::string path;
+        bool created = false;
+        for (int attempt = 0; attempt < SEGMENT_NAME_ATTEMPTS && !created; attempt++) {
+            path = segment_path(identifier, recording.next_seq, attempt);
+            created = segment_create(writer, path, pdu, recording.next_seq, record_config.segment_size);
+            if (!created && errno != EEXIST) {
+                break;
+            }
+        }
+        if (!created) {
+            std::cerr << "Failed to create segment " << path << ": " << strerror(errno) << std::endl;
+            recording.retry_after = now + RECORD_RETRY;
+            record_dropped++;
+            return;
+        }
+        std::lock_guard<std::mutex> lock(recordings_mutex);
+        recording.segments.push_back({path, pdu.frequency, pdu.multiple, recording.next_seq, 0, writer.header->first_time_ns,
+                                      writer.header->first_time_ns, record_config.segment_size});
+    }
+    segment_append(writer, pdu);
+    recording.next_seq++;
+    recording.last_append = now;
+}
+
+void enforce_retention() {  // Deletes the oldest closed segments until the recordings fit the limits
+    std::vector<std::string> expired;
+    {
+        std::lock_guard<std::mutex> lock(recordings_mutex);
+        uint64_t total = 0;
+        for (const auto& [identifier, recording] : recordings) {
+            for (const Segment& segment : recording.segments) {
+                total += segment.bytes;
+            }
+        }
+        int64_t oldest = std::numeric_limits<int64_t>::min();
+        if (record_config.retention_s > 0) {
+            oldest = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::system_clock::now().time_since_epoch()).count() -
+                     static_cast<int64_t>(record_config.retention_s) * 1000000000;
+        }
+        while (true) {
+            Recording* victim = nullptr;  // The recording whose oldest closed segment ends first
+            for (auto& [identifier, recording] : recordings) {
+                size_t closed = recording.segments.size() - (recording.writer.fd != -1 ? 1 : 0);
+                if (closed > 0 && (victim == nullptr || recording.segments.front().last_time_ns < victim->segments.front().last_time_ns)) {
+                    victim = &recording;
+                }
+            }
+            if (victim == nullptr || (total <= record_config.retention_bytes && victim->segments.front().last_time_ns >= oldest)) {
+                break;
+            }
+            total -= victim->segments.front().bytes;
+            expired.push_back(victim->segments.front().path);
+            victim->segments.erase(victim->segments.begin());
+        }
+    }
+    for (const std::string& path : expired) {
+        unlink(path.c_str());  // Replays reading it keep their descriptor open
+    }
+}
+
+void recorder_thread() {
+    try { /*  Append the samples queued by ingest to each source's open segment,
+              rotate full or idle segments and keep the recordings within the retention limits */
+        start_thread("recorder", ROLE_OTHER);
+        load_recordings();
+        std::vector<PDU_1> batch;
+        batch.reserve(MAX_RECORD_QUEUE);
+        {
+            std::lock_guard<std::mutex> lock(record_mutex);
+            record_queue.reserve(MAX_RECORD_QUEUE);  // Swapped with batch, so ingest never makes it grow
+        }
+        std::vector<Recording*> by_handle;  // Source handle - 1 to its recording
+        auto last_maintenance = std::chrono::steady_clock::now();
+
+        bool running = true;
+        while (running) {
+            running = keep_running.load();
+            {
+                std::unique_lock<std::mutex> lock(record_mutex);
+                record_cv.wait_for(lock, std::chrono::milliseconds(100), [] { return !record_queue.empty() || !keep_running.load(); });
+                batch.swap(record_queue);
+            }
+            auto now = std::chrono::steady_clock::now();
+            for (const PDU_1& pdu : batch) {
+                if (by_handle.size() < pdu.handle) {
+                    by_handle.resize(pdu.handle, nullptr);
+                }
+                Recording*& recording = by_handle[pdu.handle - 1];
+                if (recording == nullptr) {
+                    std::lock_guard<std::mutex> lock(recordings_mutex);
+                    recording = &recordings[std::string(pdu.identifier, strnlen(pdu.identifier, sizeof(pdu.identifier)))];
+                }
+                record_sample(*recording, pdu, now);
+            }
+            batch.clear();
+            {
+                std::lock_guard<std::mutex> lock(recordings_mutex);  // Let replays see what was just written
+                for (auto& [identifier, recording] : recordings) {
+                    if (recording.writer.fd != -1) {
+                        recording.segments.back().count = recording.writer.header->count;
+                        recording.segments.back().last_time_ns = recording.writer.header->last_time_ns;
+                    }
+                }
+            }
+            if (now - last_maintenance >= std::chrono::seconds(1) || !running) {
+                for (auto& [identifier, recording] : recordings) {
+                    if (recording.writer.fd != -1 && (now - recording.last_append >= RECORD_IDLE_CLOSE || !running)) {
+                        close_segment(recording);  // Gives back the preallocation of sources that went quiet
+                    }
+                }
+                enforce_retention();
+                last_maintenance = now;
+            }
+        }
+    } catch (const std::exception& e) {
+        std::cerr << "Exception in recorder_thread: " << e.what() << std::endl;
+        keep_running.store(false);
+        cv.notify_all();
+    }
+}
+
+struct ReplayJob {
+    PDU_2 request;                                   // pedido (com o endereço do cliente)
+    std::vector<Segment> segments;                   // segmentos que cobrem o intervalo
+    size_t segment = 0;                              // segmento em leitura
+    int fd = -1;                                     // ficheiro do segmento em leitura
+    uint64_t next = 0;                               // próximo registo a ler do segmento
+    int64_t from_ns;                                 // início do intervalo
+    int64_t to_ns;                                   // fim do intervalo
+    SegmentRecord buffer[256];                       // registos lidos e ainda por enviar
+    size_t buffered = 0;
+    size_t position = 0;
+    int64_t origin_ns = -1;                          // instante gravado da primeira amostra enviada
+    std::chrono::steady_clock::time_point start;     // quando a primeira amostra foi enviada
+    std::chrono::steady_clock::time_point next_due;  // quando a próxima amostra pode ser enviada
+};
+
+bool next_record(ReplayJob& job, SegmentRecord& record) {  // false once the range is exhausted
+    while (job.position == job.buffered) {
+        if (job.fd == -1) {
+            if (job.segment == job.segments.size()) {
+                return false;
+            }
+            job.fd = open(job.segments[job.segment].path.c_str(), O_RDONLY);
+            if (job.fd == -1) {  // Expired since the replay started
+                job.segment++;
+                continue;
+            }
+            job.next = segment_find_time(job.fd, job.segments[job.segment].count, job.from_ns);
+        }
+        uint64_t left = job.segments[job.segment].count - job.next;
+        job.buffered = left == 0 ? 0 : segment_read(job.fd, job.next, job.buffer, std::min<uint64_t>(left, 256));
+        job.position = 0;
+        job.next += job.buffered;
+        if (job.buffered == 0) {
+            close(job.fd);
+            job.fd = -1;
+            job.segment++;
+        }
+    }
+    record = job.buffer[job.position++];
+    return record.time_ns <= job.to_ns;
+}
+
+std::unique_ptr<ReplayJob> start_replay(const PDU_2& request) {  // nullptr if nothing was recorded in the range
+    if (record_config.dir.empty() || request.replay.from_ms >= request.replay.to_ms) {
+        return nullptr;
+    }
+    std::unique_ptr<ReplayJob> job(new ReplayJob());
+    job->request = request;
+    job->from_ns = request.replay.from_ms * 1000000;
+    job->to_ns = request.replay.to_ms * 1000000;
+    {
+        std::lock_guard<std::mutex> lock(recordings_mutex);
+        auto recording = recordings.find(std::string(request.sub.source_id, strnlen(request.sub.source_id, sizeof(request.sub.source_id))));
+        if (recording == recordings.end()) {
+            return nullptr;
+        }
+        for (const Segment& segment : recording->second.segments) {
+            if (segment.count > 0 && segment.last_time_ns >= job->from_ns && segment.first_time_ns <= job->to_ns) {
+                job->segments.push_back(segment);
+            }
+        }
+    }
+    if (job->segments.empty()) {
+        return nullptr;
+    }
+    return job;
+}
+
+bool replay_step(ReplayJob& job, int sockfd, std::chrono::steady_clock::time_point now) {
+    // Sends the samples that are due; false once the replay is over
+    PDU_2 pdu_2 = {};
+    pdu_2.sub = job.request.sub;
+    memcpy(pdu_2.type, "rply", 5);
+    memcpy(pdu_2.pdu.identifier, job.request.sub.source_id, sizeof(pdu_2.pdu.identifier));
+    auto min_gap = std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(1.0 / record_config.replay_rate));
+    job.next_due = std::max(job.next_due, now - std::chrono::milliseconds(10));  // Don't make up for long stalls in one burst
+    for (int sent = 0; sent < IO_BATCH && job.next_due <= now; sent++) {
+        SegmentRecord record;
+        if (!next_record(job, record)) {
+            return false;
+        }
+        const Segment& segment = job.segments[job.segment < job.segments.size() ? job.segment : job.segments.size() - 1];
+        pdu_2.pdu.i = record.i;
+        pdu_2.pdu.value = record.value;
+        pdu_2.pdu.period = record.period;
+        pdu_2.pdu.max_period = record.max_period;
+        pdu_2.pdu.frequency = segment.frequency;
+        pdu_2.pdu.multiple = segment.multiple;
+        pdu_2.pdu.timestamp = std::chrono::system_clock::time_point(std::chrono::duration_cast<std::chrono::system_clock::duration>(std::chrono::nanoseconds(record.time_ns)));
+        if (sendto(sockfd, &pdu_2, sizeof(pdu_2), 0, (struct sockaddr*)&pdu_2.sub.clientAddr, sizeof(pdu_2.sub.clientAddr)) == -1) {
+            std::cerr << "Failed to send replayed sample to client." << std::endl;
+        }
+        if (job.origin_ns < 0) {
+            job.origin_ns = record.time_ns;
+            job.start = now;
+        }
+        job.next_due += min_gap;
+        if (job.request.replay.speed > 0) {  // Keep the recorded spacing, sped up
+            auto offset = std::chrono::nanoseconds((record.time_ns - job.origin_ns) / job.request.replay.speed);
+            job.next_due = std::max(job.next_due, job.start + std::chrono::duration_cast<std::chrono::steady_clock::duration>(offset));
+        }
+    }
+    return true;
+}
+
+void replay_thread(int sockfd) {
+    try { /*  Serve replay requests: every replay reads its segments in order and sends the samples
+              paced at its speed (and at most replay_rate per second), several replays at a time */
+        start_thread("replay", ROLE_CONTROL);
+        std::vector<std::unique_ptr<ReplayJob>> jobs;
+        std::vector<PDU_2> requests;
+        while (keep_running.load()) {
+            {
+                std::unique_lock<std::mutex> lock(replay_mutex);
+                auto wake = std::chrono::steady_clock::now() + std::chrono::milliseconds(100);
+                for (const auto& job : jobs) {
+                    wake = std::min(wake, job->next_due);
+                }
+                replay_cv.wait_until(lock, wake, [] { return !replay_requests.empty() || !keep_running.load(); });
+                requests.assign(replay_requests.begin(), replay_requests.end());
+                replay_requests.clear();
+            }
+            for (PDU_2& request : requests) {
+                std::unique_ptr<ReplayJob> job = start_replay(request);
+                send_ack(request, sockfd, job ? "ack" : "nack");
+                if (job) {
+                    job->next_due = std::chrono::steady_clock::now();
+                    jobs.push_back(std::move(job));
+                }
+            }
+            auto now = std::chrono::steady_clock::now();
+            for (size_t k = 0; k < jobs.size();) {
+                if (replay_step(*jobs[k], sockfd, now)) {
+                    k++;
+                    continue;
+                }
+                PDU_2 done = {};  // Tells the client the range is over
+                done.sub = jobs[k]->request.sub;
+                memcpy(done.type, "done", 5);
+                memcpy(done.pdu.identifier, done.sub.source_id, sizeof(done.pdu.identifier));
+                if (sendto(sockfd, &done, sizeof(done), 0, (struct sockaddr*)&done.sub.clientAddr, sizeof(done.sub.clientAddr)) == -1) {
+                    std::cerr << "Failed to send end of replay to client." << std::endl;
+                }
+                if (jobs[k]->fd != -1) {
+                    close(jobs[k]->fd);
+                }
+                jobs.erase(jobs.begin() + k);
+            }
+        }
+        for (auto& job : jobs) {
+            if (job->fd != -1) {
+                close(job->fd);
             }
-            new_notification.store(true);
-            cv.notify_one();
         }
-        close(sockfd);
     } catch (const std::exception& e) {
-        std::cerr << "Exception in received_pdu: " << e.what() << std::endl;
+        std::cerr << "Exception in replay_thread: " << e.what() << std::endl;
         keep_running.store(false);
         cv.notify_all();
     }
 }
 
-void send_pdu(const std::string ip, int port) {
-    try { /*  Continuously check for new PDUs in the list of processed PDUs
-              Identify subscribed clients for each PDU and send the PDU to those clients */
-        int sockfd;
-        struct sockaddr_in serverAddr;
-        memset(&serverAddr, 0, sizeof(serverAddr));
-
-        create_sender_socket(ip, port, sockfd, serverAddr);
-
-        while (keep_running.load()) {
-            {
-                std::unordered_set<std::string> sent_pdus;
-                std::unique_lock<std::mutex> lock(sources_mutex);
-                cv.wait(lock, [] { return !sources_map.empty() && !subscriber_list.empty() && new_notification.load(); });
-                std::unique_lock<std::mutex> sub_lock(client_mutex);
-                PDU_2 pdu = {};
-
-                for (auto& subscriber : subscriber_list) {
-                    auto source = sources_map.find(subscriber.second.source_id);
-                    if (source != sources_map.end() && source->second.sent == false && source->second.period != 0 && subscriber.second.credits > 0) {
-                        pdu.id = 0;
-                        char type[] = "data";
-                        size_t length = strlen(type);
-                        memcpy(pdu.type, type, length);
-                        pdu.type[length] = '\0';
-                        pdu.pdu = sources_map[subscriber.second.source_id];
-                        subscriber.second.credits -= 1;
-                        pdu.sub = subscriber.second;
-                        ssize_t bytes_sent = sendto(sockfd, &pdu, sizeof(pdu), 0, (struct sockaddr*)&subscriber.second.clientAddr, sizeof(subscriber.second.clientAddr));
-                        if (bytes_sent == -1) {
-                            std::cerr << "Failed to send response to client." << std::endl;
-                        }
-                        sent_pdus.insert(subscriber.second.source_id);
-                    }
-                }
-                sub_lock.unlock();
-                for (auto& pdu_id : sent_pdus) {
-                    auto source = sources_map.find(pdu_id);
-                    if (source != sources_map.end()) {
-                        source->second.sent = true;
-                    }
-                }
+void manage_client_requests(int sockfd, int credits) {
+    try { /*  Listen for client commands (e.g., list, info(D), play(D), stop(D))
+          and hand them to the request workers, which update the list of subscribed clients */
+        start_thread("control", ROLE_CONTROL);
+        std::vector<std::thread> workers;
+        for (auto& queue : request_queues) {  // One worker per queue (--control-threads)
+            workers.emplace_back(request_worker, std::ref(*queue), sockfd, credits);
+        }
+        std::thread replayer(replay_thread, sockfd);
 
-                new_notification.store(false);
-            }
+        bool received = false;
+#ifdef SM_HAVE_IO_URING
+        received = io_backend == IO_URING && receive_requests_uring(sockfd);
+#endif
+        if (!received) {
+            receive_requests_socket(sockfd);
+        }
+        wake_request_workers();
+        replay_cv.notify_all();
+        for (auto& worker : workers) {
+            worker.join();
         }
+        replayer.join();
     } catch (const std::exception& e) {
-        std::cerr << "Exception in send_pdu: " << e.what() << std::endl;
+        std::cerr << "Exception in manage_client_requests: " << e.what() << std::endl;
         keep_running.store(false);
         cv.notify_all();
+        wake_request_workers();
     }
 }
 
-void send_monitor_data(const std::string ip, int port) {
-    try {
-        int sockfd;
-        struct sockaddr_in monitorAddr;
-        memset(&monitorAddr, 0, sizeof(monitorAddr));
+std::vector<char> encode_state() {  // Snapshot of the source registry and of the subscriptions with their credits
+    SnapshotHeader header = {};
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+    header.version = SNAPSHOT_VERSION;
+    header.source_size = sizeof(SnapshotSource);
+    header.subscription_size = sizeof(SnapshotSubscription);
+    header.saved_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+    std::vector<char> state;
+    auto source_lock = traced_lock(sources_mutex, LOCK_SOURCES);
+    auto sub_lock = traced_lock(client_mutex, LOCK_CLIENTS);
+    {
+        auto lock = traced_lock(catalog_mutex, LOCK_CATALOG);
+        header.catalog_version = catalog_version;
+    }
+    header.n_sources = source_slots.size();
+    header.n_subscriptions = n_subscriptions.load();
+    state.reserve(sizeof(header) + header.n_sources * sizeof(SnapshotSource) + header.n_subscriptions * sizeof(SnapshotSubscription));
+    snapshot_append(state, &header, sizeof(header));
+    for (const SourceSlot& slot : source_slots) {
+        SnapshotSource source = {};
+        source.pdu = slot.pdu;
+        source.active = slot.active;
+        source.relayed = slot.relayed;
+        snapshot_append(state, &source, sizeof(source));
+    }
+    for (const Subscription& subscription : subscriptions) {
+        if (!subscription.active) {
+            continue;
+        }
+        const ClientEntry& client = clients[subscription.client];
+        SnapshotSubscription saved = {};
+        memcpy(saved.client_id, client.key.client_id, sizeof(saved.client_id));
+        saved.clientAddr = client.clientAddr;
+        saved.source = subscription.source;
+        saved.credits = subscription.credits;
+        saved.view = source_views[subscription.source - 1][subscription.view].view;
+        saved.filter = subscription.filter;
+        snapshot_append(state, &saved, sizeof(saved));
+    }
+    return state;
+}
 
-        create_sender_socket(ip, port, sockfd, monitorAddr);
+bool restore_state(const std::vector<char>& state) {  // Called before the SM threads start; false if state can't be used
+    Snapshot snapshot;
+    if (!snapshot_parse(state, snapshot)) {
+        return false;
+    }
+    auto source_lock = traced_lock(sources_mutex, LOCK_SOURCES);
+    auto sub_lock = traced_lock(client_mutex, LOCK_CLIENTS);
+    uint32_t n_sources = std::min<size_t>(snapshot.header.n_sources, capacity_config.max_sources);
+    if (n_sources < snapshot.header.n_sources) {
+        std::cerr << "Only restoring the first " << n_sources << " of " << snapshot.header.n_sources << " sources (--max-sources)." << std::endl;
+    }
+    for (uint32_t k = 0; k < n_sources; k++) {  // Slot k keeps handle k + 1, which its source still sends
+        const SnapshotSource& source = snapshot.sources[k];
+        source_slots.emplace_back();
+        SourceSlot& slot = source_slots.back();
+        slot = {};
+        slot.pdu = source.pdu;
+        slot.pdu.handle = k + 1;
+        slot.relayed = source.relayed;
+        source_handles.insert(source_key(slot.pdu.identifier), k + 1);
+        if (source.active) {  // Sources that stopped meanwhile expire at the first cleanup
+            slot.active = true;
+            n_active_sources++;
+            if (!slot.relayed) {  // Relayed ones are listed again by the relay thread from the upstream catalog
+                catalog_update(slot.pdu.identifier, false);
+            }
+        }
+    }
+    for (uint32_t k = 0; k < snapshot.header.n_subscriptions; k++) {
+        const SnapshotSubscription& saved = snapshot.subscriptions[k];
+        View view = saved.view;
+        if (saved.source == 0 || saved.source > source_slots.size() || !valid_view(view)) {
+            continue;
+        }
+        Subscriber sub = {};
+        memcpy(sub.client_id, saved.client_id, sizeof(sub.client_id) - 1);
+        sub.clientAddr = saved.clientAddr;
+        int32_t client = find_client(sub);
+        bool added = client < 0;
+        if (added && (client = add_client(sub)) < 0) {
+            continue;  // No room for the client (admission_rejected counts it)
+        }
+        const char* source_id = source_slots[saved.source - 1].pdu.identifier;
+        if (find_subscription(client, source_id) >= 0) {
+            continue;
+        }
+        SourceSlot& slot = source_slots[saved.source - 1];
+        if (view.decimation > 0 || view.window_ms > 0) {
+            if (slot.backlog.capacity() < MAX_BACKLOG) {
+                slot.backlog.reserve(MAX_BACKLOG);
+            }
+            slot.keep_backlog = true;
+        }
+        int32_t handle = add_subscription(client, saved.source, source_id, saved.credits, view);
+        if (handle >= 0) {
+            subscriptions[handle].filter = saved.filter;
+        } else if (added) {
+            remove_client(client);
+        }
+    }
+    // The change history is gone: clients that follow the catalog see a version after theirs and relist
+    auto lock = traced_lock(catalog_mutex, LOCK_CATALOG);
+    catalog_version = std::max(catalog_version, snapshot.header.catalog_version + 1);
+    catalog_changes_head = 0;
+    catalog_changes_count = 0;
+    return true;
+}
 
-        size_t previous_sources_size = 0;
-        size_t previous_subscribers_size = 0;
+void save_state() {
+    if (!snapshot_write(state_config.path, encode_state())) {
+        std::cerr << "Failed to save the SM state to " << state_config.path << "." << std::endl;
+    }
+}
 
-        while (keep_running.load()) {
-            size_t current_sources_size = 0;
-            size_t current_subscribers_size = 0;
+void stop_threads() {  // Stops the SM, waking the threads blocked on a condition variable, in epoll or in a receive
+    keep_running.store(false);
+    for (std::mutex* mutex : {&sources_mutex, &request_mutex, &replay_mutex, &record_mutex, &stop_mutex}) {
+        std::lock_guard<std::mutex> lock(*mutex);  // A thread between checking keep_running and waiting can't miss the notify
+    }
+    cv.notify_all();
+    wake_request_workers();
+    replay_cv.notify_all();
+    record_cv.notify_all();
+    stop_cv.notify_all();
+    for (auto& lane : egress_lanes) {
+        uint64_t wakeup = 1;
+        int event = lane->event.load();
+        if (event != -1 && write(event, &wakeup, sizeof(wakeup)) == -1) {
+            std::cerr << "Failed to wake up an egress thread." << std::endl;
+        }
+    }
+    wake_receiver(node_config.ingest_port);  // The ingest threads then wake each other up
+    wake_receiver(node_config.control_port);
+}
 
-            {
-                std::lock_guard<std::mutex> lock(sources_mutex);
-                current_sources_size = sources_map.size();
-            }
-            {
-                std::lock_guard<std::mutex> lock(client_mutex);
-                current_subscribers_size = subscriber_list.size();
+void handoff_thread(int listenfd) {
+    try { /*  Wait for a new SM process to ask for this one's sockets and state; when one connects,
+              stop the SM so that main hands them over once every thread let go of the sockets */
+        start_thread("handoff", ROLE_OTHER);
+        while (keep_running.load()) {
+            struct pollfd ready = {listenfd, POLLIN, 0};
+            if (poll(&ready, 1, 100) != 1) {
+                continue;
             }
-            if (current_sources_size != previous_sources_size || current_subscribers_size != previous_subscribers_size) {
-                PDU_3 pdu_3;
-                pdu_3.n_sources = current_sources_size;
-                pdu_3.n_subscribers = current_subscribers_size;
-
-                ssize_t bytes_sent = sendto(sockfd, &pdu_3, sizeof(pdu_3), 0, (struct sockaddr*)&monitorAddr, sizeof(monitorAddr));
-                if (bytes_sent == -1) {
-                    std::cerr << "Failed to send PDU_3 to monitor." << std::endl;
-                }
-                previous_sources_size = current_sources_size;
-                previous_subscribers_size = current_subscribers_size;
+            int conn = accept(listenfd, nullptr, nullptr);
+            if (conn == -1) {
+                continue;
             }
-            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            unlink(state_config.handoff_path.c_str());  // The new process listens on the path from now on
+            handoff_conn.store(conn);
+            stop_threads();
         }
-        close(sockfd);
+        close(listenfd);
     } catch (const std::exception& e) {
-        std::cerr << "Exception in send_monitor_data thread: " << e.what() << std::endl;
+        std::cerr << "Exception in handoff_thread: " << e.what() << std::endl;
         keep_running.store(false);
         cv.notify_all();
     }
 }
 
-void get_sources_list(PDU_2& pdu_2) {  // Gets list of active sources and stores in pdu_2
-    int i = 0;
-    int size = sizeof(pdu_2.active_sources);
-    {
-        std::lock_guard<std::mutex> lock(sources_mutex);
-        for (const auto& pdu : sources_map) {
-            if (i >= size) {
-                break;  // Ensuring we don't exceed the size of active_sources array
-            }
-            std::strncpy(pdu_2.active_sources + i, pdu.first.c_str(), size - i);
-            i += std::min(size - i, static_cast<int>(pdu.first.length()));
-        }
-    }
-    pdu_2.active_sources[i] = '\0';
-}
+struct UpstreamSubscription {
+    uint32_t handle;                                  // handle local da fonte
+    int credits;                                      // créditos que ainda temos no SM de cima
+    std::chrono::steady_clock::time_point last_play;  // último play (ou reposição de créditos) enviado
+    std::chrono::steady_clock::time_point last_data;  // última amostra recebida
+};
 
-void send_ack(PDU_2& pdu_2, int sockfd) {
-    std::string type("ack");
-    size_t length = strlen(type.c_str());
-    size_t max_size = sizeof(pdu_2.type);
-    size_t bytes_sent;
-    pdu_2.id = 5;
-    if (length < max_size) {
-        memcpy(pdu_2.type, type.c_str(), length);
-        pdu_2.type[length] = '\0';
-    } else {
-        std::cerr << "Length of type bigger than allowed." << std::endl;
-    }
+struct UpstreamCatalog {
+    std::set<std::string> sources;                       // fontes que o SM de cima lista
+    uint64_t version = 0;                                // versão do catálogo de cima já aplicada
+    bool listed = false;                                 // já temos uma listagem completa
+    bool listing = false;                                // listagem em curso (página a página)
+    std::set<std::string> pages;                         // fontes das páginas já recebidas
+    uint64_t listing_version = 0;                        // versão da primeira página
+    std::chrono::steady_clock::time_point next_request;  // próximo pedido de alterações (ou nova listagem)
+};
 
-    if ((bytes_sent = sendto(sockfd, &pdu_2, sizeof(pdu_2), 0, (struct sockaddr*)&pdu_2.sub.clientAddr, sizeof(pdu_2.sub.clientAddr))) < 0) {
-        std::cerr << "Failed to send response to client." << std::endl;
+void apply_upstream_listing(UpstreamCatalog& catalog) {  // Replaces the upstream part of our catalog with a full listing
+    for (const std::string& identifier : catalog.sources) {
+        if (catalog.pages.count(identifier) == 0) {
+            catalog_update(identifier.c_str(), true, CATALOG_UPSTREAM);
+        }
     }
+    for (const std::string& identifier : catalog.pages) {
+        catalog_update(identifier.c_str(), false, CATALOG_UPSTREAM);
+    }
+    catalog.sources.swap(catalog.pages);
+    catalog.pages.clear();
+    catalog.version = catalog.listing_version;
+    catalog.listed = true;
+    catalog.listing = false;
 }
 
-void process_request(PDU_2 pdu_2, int sockfd, int credits) {  // Process user requests
-    ssize_t bytes_sent = 0;
-    PDU_1 pdu;
-    switch (pdu_2.id) {
-        case 1:  // List sources
-            // Looks up for sources available
-            get_sources_list(pdu_2);
-            bytes_sent = sendto(sockfd, &pdu_2, sizeof(pdu_2), 0, (struct sockaddr*)&pdu_2.sub.clientAddr, sizeof(pdu_2.sub.clientAddr));
-            if (bytes_sent == -1) {
-                std::cerr << "Failed to send response to client." << std::endl;
+void relay_thread() {
+    try { /*  Relay the sources of an upstream SM: mirror its catalog into ours, hold a single upstream
+              subscription per source our clients play (however many they are), play again before its
+              credits run out, and feed what arrives to the fan-out as if the source were local.
+              Relays must form a tree: a source offered back to an SM that relays it is not detected */
+        start_thread("relay", ROLE_INGEST);
+        int sockfd;
+        struct sockaddr_in upstream;
+        create_sender_socket(node_config.upstream_ip, node_config.upstream_port, sockfd, upstream);
+        if (sockfd < 0) {
+            throw std::runtime_error("can't create the upstream socket");
+        }
+        int buffer_size = 4 << 20;
+        setsockopt(sockfd, SOL_SOCKET, SO_RCVBUF, &buffer_size, sizeof(buffer_size));
+        struct timeval timeout = {0, static_cast<suseconds_t>(std::chrono::microseconds(RELAY_PERIOD).count())};
+        setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+        char client_id[sizeof(Subscriber::client_id)] = {};
+        snprintf(client_id, sizeof(client_id), "relay%d", node_config.control_port);
+        uint32_t req_id = 0;
+        auto send_upstream = [&](const void* pdu, size_t length) {
+            if (sendto(sockfd, pdu, length, 0, (struct sockaddr*)&upstream, sizeof(upstream)) == -1) {
+                std::cerr << "Failed to send request to upstream SM." << std::endl;
             }
-            break;
-        case 2:  // Get source info
-            // Looks up for info about the required source
-            pdu = {};
-            {
-                std::lock_guard<std::mutex> lock(sources_mutex);
-                if (sources_map.count(pdu_2.pdu.identifier) > 0) {
-                    pdu = sources_map[pdu_2.pdu.identifier];
+        };
+        auto request_source = [&](int id, const std::string& identifier) {  // Play (id 3) or stop (id 4) one source
+            PDU_2 pdu_2 = {};
+            pdu_2.id = id;
+            pdu_2.req_id = ++req_id;
+            memcpy(pdu_2.type, id == 3 ? "play" : "stop", 5);
+            memcpy(pdu_2.sub.client_id, client_id, sizeof(pdu_2.sub.client_id));
+            memcpy(pdu_2.sub.source_id, identifier.c_str(), std::min(identifier.length(), sizeof(pdu_2.sub.source_id) - 1));
+            memcpy(pdu_2.pdu.identifier, pdu_2.sub.source_id, sizeof(pdu_2.pdu.identifier));
+            send_upstream(&pdu_2, sizeof(pdu_2));
+        };
+        auto request_catalog = [&](int id, const char* cursor, uint64_t version) {  // Page (id 7) or changes (id 8)
+            PDU_4 pdu_4 = {};
+            pdu_4.id = id;
+            pdu_4.req_id = ++req_id;
+            memcpy(pdu_4.client_id, client_id, sizeof(pdu_4.client_id));
+            memcpy(pdu_4.cursor, cursor, strnlen(cursor, sizeof(pdu_4.cursor) - 1));
+            pdu_4.version = version;
+            send_upstream(&pdu_4, sizeof(pdu_4));
+        };
+
+        std::unordered_map<std::string, UpstreamSubscription> upstream_subscriptions;
+        UpstreamCatalog catalog;
+        std::vector<std::pair<std::string, uint32_t>> wanted;  // Sources our clients play that only upstream feeds
+        std::set<std::string> still_wanted;
+        auto next_scan = std::chrono::steady_clock::now();
+        std::vector<char> buffer(REQUEST_SIZE);
+        PDU_1 pdus[IO_BATCH];
+        struct sockaddr_in addrs[IO_BATCH] = {};
+        int n = 0;
+
+        while (keep_running.load()) {
+            auto now = std::chrono::steady_clock::now();
+            if (now >= catalog.next_request) {
+                if (!catalog.listed || catalog.listing) {  // (Re)list from the start, also when a page got lost
+                    catalog.listing = true;
+                    catalog.pages.clear();
+                    catalog.listing_version = 0;
+                    request_catalog(7, "", 0);
+                    catalog.next_request = now + 3 * RELAY_CATALOG_PERIOD;
+                } else {
+                    request_catalog(8, "", catalog.version);
+                    catalog.next_request = now + RELAY_CATALOG_PERIOD;
                 }
             }
-            pdu_2.pdu = pdu;
 
-            bytes_sent = sendto(sockfd, &pdu_2, sizeof(pdu_2), 0, (struct sockaddr*)&pdu_2.sub.clientAddr, sizeof(pdu_2.sub.clientAddr));
-            if (bytes_sent == -1) {
-                std::cerr << "Failed to send response to client." << std::endl;
-            }
-            break;
-        case 3:  // Play from source
-            // Adds subscriber to subscriber list and notifies sender thread to send to new sub.
-            {
-                std::unique_lock<std::mutex> source_lock(sources_mutex);
-                if (sources_map.count(pdu_2.sub.source_id) > 0) {
-                    pdu_2.sub.credits = 100;
-                    std::unique_lock<std::mutex> sub_lock(client_mutex);
-                    if (subscriber_list.count(pdu_2.sub.clientAddr.sin_port) > 0) {
-                        subscriber_list[pdu_2.sub.clientAddr.sin_port].credits = 100;
-                        send_ack(pdu_2, sockfd);
-                        sub_lock.unlock();
-                        source_lock.unlock();
+            if (now >= next_scan) {
+                wanted.clear();
+                {
+                    auto source_lock = traced_lock(sources_mutex, LOCK_SOURCES);
+                    auto sub_lock = traced_lock(client_mutex, LOCK_CLIENTS);
+                    for (uint32_t handle = 1; handle <= source_slots.size(); handle++) {
+                        const SourceSlot& slot = source_slots[handle - 1];
+                        if (slot.active && !slot.relayed) {
+                            continue;  // Fed by the source itself
+                        }
+                        for (const SourceView& view : source_views[handle - 1]) {
+                            if (view.active && view.n_subscriptions > 0) {
+                                wanted.emplace_back(std::string(slot.pdu.identifier, strnlen(slot.pdu.identifier, sizeof(slot.pdu.identifier))), handle);
+                                break;
+                            }
+                        }
+                    }
+                }
+                still_wanted.clear();
+                for (const auto& [identifier, handle] : wanted) {
+                    if (catalog.sources.count(identifier) == 0) {
+                        continue;  // Upstream doesn't have it (any more)
+                    }
+                    still_wanted.insert(identifier);
+                    auto found = upstream_subscriptions.find(identifier);
+                    if (found == upstream_subscriptions.end()) {
+                        upstream_subscriptions[identifier] = {handle, 0, now, {}};
+                        request_source(3, identifier);
+                    } else if (now - std::max(found->second.last_play, found->second.last_data) > RELAY_RETRY) {
+                        found->second.last_play = now;  // Lost play, or the upstream subscription expired
+                        request_source(3, identifier);
+                    }
+                }
+                for (auto it = upstream_subscriptions.begin(); it != upstream_subscriptions.end();) {
+                    if (still_wanted.count(it->first) == 0) {
+                        request_source(4, it->first);
+                        it = upstream_subscriptions.erase(it);
                     } else {
-                        subscriber_list[pdu_2.sub.clientAddr.sin_port] = pdu_2.sub;
-                        send_ack(pdu_2, sockfd);
-                        sub_lock.unlock();
-                        source_lock.unlock();
+                        ++it;
                     }
-                    cv.notify_one();
                 }
+                next_scan = now + RELAY_PERIOD;
             }
-            break;
-        case 4:  // Stop playing from source
-            // Removes subscribers
-            {
-                std::unique_lock<std::mutex> lock(client_mutex);
-                if (subscriber_list.count(pdu_2.sub.clientAddr.sin_port) > 0) {
-                    subscriber_list.erase(pdu_2.sub.clientAddr.sin_port);
-                    send_ack(pdu_2, sockfd);
-                    lock.unlock();
+
+            // Wait for the first datagram, then take whatever else is already queued
+            int flags = 0;
+            ssize_t length;
+            for (int received = 0; received < IO_BATCH && (length = recv(sockfd, buffer.data(), buffer.size(), flags)) > 0; received++) {
+                flags = MSG_DONTWAIT;
+                int id;
+                if (static_cast<size_t>(length) < sizeof(id)) {
+                    continue;
                 }
-            }
-            break;
-        case 6:
-            // Get subscribed sources
-            {
-                std::unique_lock<std::mutex> lock(client_mutex);
-                auto subscriber = subscriber_list.find(pdu_2.sub.clientAddr.sin_port);
-                if (subscriber != subscriber_list.end()) {
-                    pdu_2.sub = subscriber->second;
-                    bytes_sent = sendto(sockfd, &pdu_2, sizeof(pdu_2), 0, (struct sockaddr*)&pdu_2.sub.clientAddr, sizeof(pdu_2.sub.clientAddr));
-                    if (bytes_sent == -1) {
-                        std::cerr << "Failed to send response to client." << std::endl;
+                memcpy(&id, buffer.data(), sizeof(id));
+                if ((id == 7 || id == 8) && length == sizeof(PDU_4)) {
+                    PDU_4 pdu_4;
+                    memcpy(&pdu_4, buffer.data(), sizeof(pdu_4));
+                    if (id == 7 && catalog.listing) {
+                        if (catalog.listing_version == 0) {
+                            catalog.listing_version = pdu_4.version;  // Changes after the first page come from the feed
+                        }
+                        for (int k = 0; k < pdu_4.count && k < CATALOG_PAGE_SIZE; k++) {
+                            const char* identifier = pdu_4.entries[k].identifier;
+                            catalog.pages.insert(std::string(identifier, strnlen(identifier, sizeof(pdu_4.entries[k].identifier))));
+                        }
+                        if (pdu_4.more) {
+                            request_catalog(7, pdu_4.cursor, 0);
+                        } else {
+                            apply_upstream_listing(catalog);
+                            catalog.next_request = std::chrono::steady_clock::now() + RELAY_CATALOG_PERIOD;
+                        }
+                    } else if (id == 8 && catalog.listed && !catalog.listing) {
+                        if (pdu_4.reset) {
+                            catalog.listed = false;  // We fell behind the change history: list again
+                            catalog.next_request = {};
+                        } else if (pdu_4.version > catalog.version) {
+                            for (int k = 0; k < pdu_4.count && k < CATALOG_PAGE_SIZE; k++) {
+                                const char* identifier = pdu_4.entries[k].identifier;
+                                std::string key(identifier, strnlen(identifier, sizeof(pdu_4.entries[k].identifier)));
+                                if (pdu_4.entries[k].removed) {
+                                    catalog.sources.erase(key);
+                                } else {
+                                    catalog.sources.insert(key);
+                                }
+                                catalog_update(key.c_str(), pdu_4.entries[k].removed, CATALOG_UPSTREAM);
+                            }
+                            catalog.version = pdu_4.version;
+                            if (pdu_4.more) {
+                                request_catalog(8, "", catalog.version);
+                            }
+                        }
                     }
+                    continue;
                 }
-                lock.unlock();
+                if (length != sizeof(PDU_2)) {
+                    continue;
+                }
+                PDU_2 pdu_2;
+                memcpy(&pdu_2, buffer.data(), sizeof(pdu_2));
+                std::string identifier(pdu_2.sub.source_id, strnlen(pdu_2.sub.source_id, sizeof(pdu_2.sub.source_id)));
+                auto found = upstream_subscriptions.find(identifier);
+                if (found == upstream_subscriptions.end()) {
+                    continue;  // Data still in flight after a stop
+                }
+                UpstreamSubscription& subscription = found->second;
+                if (pdu_2.id == 5) {
+                    if (strncmp(pdu_2.type, "nack", sizeof(pdu_2.type)) == 0) {
+                        upstream_subscriptions.erase(found);  // Gone upstream: tried again at the next scan if still listed
+                    }
+                    continue;
+                }
+                if (pdu_2.id != 0 || strncmp(pdu_2.type, "data", sizeof(pdu_2.type)) != 0) {
+                    continue;
+                }
+                now = std::chrono::steady_clock::now();
+                subscription.credits = pdu_2.sub.credits;
+                subscription.last_data = now;
+                if (subscription.credits < RELAY_REFILL_BELOW && now - subscription.last_play >= RELAY_PERIOD) {
+                    subscription.last_play = now;  // Refill well before running out, at most one play in flight
+                    request_source(3, identifier);
+                }
+                pdus[n] = pdu_2.pdu;
+                pdus[n].handle = subscription.handle;
+                n++;
             }
-            break;
-        default:
-            std::cerr << "Invalid request from client." << std::endl;
-    }
-}
-
-void manage_client_requests(const std::string ip, int port, int credits) {
-    try { /*  Listen for client commands (e.g., list, info(D), play(D), stop(D))
-          Update the list of subscribed clients based on commands received */
-        int sockfd;
-        struct sockaddr_in serverAddr, clientAddr;
-        memset(&serverAddr, 0, sizeof(serverAddr));
-
-        create_receiver_socket(port, sockfd, serverAddr);
-        // std::cout << "socket created with port = " << serverAddr.sin_port << std::endl;
-
-        while (keep_running.load()) {
-            memset(&clientAddr, 0, sizeof(clientAddr));
-            socklen_t clientAddrLen = sizeof(clientAddr);
-            PDU_2 pdu_2;
-            ssize_t bytes_received = recvfrom(sockfd, &pdu_2, sizeof(PDU_2), 0, (struct sockaddr*)&clientAddr, &clientAddrLen);
-
-            if (bytes_received == -1) {
-                std::cerr << "Error receiving client request." << std::endl;
-                continue;
+            if (n > 0) {
+                ingest_batch(pdus, addrs, n, -1, true);
+                n = 0;
             }
-            memcpy(&pdu_2.sub.clientAddr, &clientAddr, sizeof(clientAddr));
-            // print_pdu_2(pdu_2);
-            process_request(pdu_2, sockfd, credits);
         }
+        request_source(4, "");  // Leave the upstream SM without subscriptions of ours
         close(sockfd);
     } catch (const std::exception& e) {
-        std::cerr << "Exception in manage_client_requests: " << e.what() << std::endl;
+        std::cerr << "Exception in relay_thread: " << e.what() << std::endl;
         keep_running.store(false);
         cv.notify_all();
     }
 }
 
+void expire_sources(std::chrono::system_clock::time_point now) {  // Called with sources_mutex held
+    std::chrono::microseconds tolerance(200);
+    std::chrono::microseconds relay_tolerance(RELAY_TOLERANCE);  // Relayed samples also cross the upstream SM
+    for (SourceSlot& slot : source_slots) {
+        if (!slot.active) {
+            continue;
+        }
+        std::chrono::microseconds pdu_period = std::chrono::microseconds(1000000 / (slot.pdu.frequency * slot.pdu.multiple));
+        if (now - slot.pdu.timestamp > pdu_period + (slot.relayed ? relay_tolerance : tolerance)) {
+            slot.active = false;
+            n_active_sources--;
+            if (!slot.relayed) {
+                catalog_update(slot.pdu.identifier, true);
+            }
+            trace(TRACE_SOURCE_EXPIRED, &slot - source_slots.data() + 1);
+        }
+    }
+}
+
+void remove_finished_subscriptions() {  // Called with client_mutex held: drops spent subscriptions and slow consumers
+    for (uint32_t handle = 0; handle < subscriptions.size(); handle++) {
+        if (subscriptions[handle].active && subscriptions[handle].credits == 0) {
+            remove_subscription(handle);
+        }
+    }
+    for (ClientEntry& client : clients) {
+        if (client.active && client.egress->disconnect.load()) {  // Slow consumers lose every subscription
+            uint32_t handle = client.first_subscription;
+            while (handle != NO_ENTRY) {
+                uint32_t next = subscriptions[handle].next_in_client;  // Read before the subscription (and at last the client) goes
+                remove_subscription(handle);
+                handle = next;
+            }
+        }
+    }
+}
+
 void cleanup_thread(int period) {
     try {
+        start_thread("cleanup", ROLE_OTHER);
+        auto next_save = std::chrono::steady_clock::now() + std::chrono::seconds(state_config.interval_s);
         while (keep_running.load()) {
-            std::chrono::microseconds tolerance(200);
-            std::vector<std::string> sources_id;
-            std::vector<in_port_t> sub_id;
+            if (trace_dump_requested.exchange(false) && !trace_dump(trace_path)) {
+                std::cerr << "Failed to dump the flight recorder to " << trace_path << "." << std::endl;
+            }
             {
-                std::lock_guard<std::mutex> lock(sources_mutex);
-                if (!sources_map.empty()) {
-                    for (const auto& pdu : sources_map) {
-                        std::chrono::microseconds pdu_period = std::chrono::microseconds(1000000 / (pdu.second.frequency * pdu.second.multiple));
-                        if (std::chrono::system_clock::now() - pdu.second.timestamp > pdu_period + tolerance) {
-                            std::string source_id = pdu.second.identifier;
-                            sources_id.push_back(source_id);
-                        }
-                    }
-                    for (const auto& id : sources_id) {
-                        sources_map.erase(id);
-                    }
-                }
+                auto lock = traced_lock(sources_mutex, LOCK_SOURCES);
+                expire_sources(std::chrono::system_clock::now());
             }
             {
-                std::lock_guard<std::mutex> lock(client_mutex);
-                if (!subscriber_list.empty()) {
-                    for (const auto& sub : subscriber_list) {
-                        if (sub.second.credits == 0) {
-                            sub_id.push_back(sub.first);
-                        }
-                    }
-                    for (const auto& id : sub_id) {
-                        subscriber_list.erase(id);
-                    }
-                }
+                auto lock = traced_lock(client_mutex, LOCK_CLIENTS);
+                remove_finished_subscriptions();
             }
-            std::this_thread::sleep_for(std::chrono::seconds(period));
+            if (!state_config.path.empty() && state_config.interval_s > 0 && std::chrono::steady_clock::now() >= next_save) {
+                save_state();
+                next_save = std::chrono::steady_clock::now() + std::chrono::seconds(state_config.interval_s);
+            }
+            std::unique_lock<std::mutex> lock(stop_mutex);
+            stop_cv.wait_for(lock, std::chrono::seconds(period), [] { return !keep_running.load(); });
         }
     } catch (const std::exception& e) {
         std::cerr << "Exception in cleanup_thread: " << e.what() << std::endl;
@@ -335,23 +2670,359 @@ void cleanup_thread(int period) {
     }
 }
 
-int main() {
+void print_usage(const char* program) {
+    std::cerr << "Usage: " << program << " [options]" << std::endl;
+    std::cerr << "  --ingest-port PORT       where sources send their samples (default 12345)" << std::endl;
+    std::cerr << "  --control-port PORT      where clients send their requests (default 12347)" << std::endl;
+    std::cerr << "  --monitor-port PORT      where the statistics are sent, on 127.0.0.1 (default 12365)" << std::endl;
+    std::cerr << "  --upstream IP:PORT       relay the sources of the SM whose control port is IP:PORT (default off)" << std::endl;
+    std::cerr << "  --state-file PATH        save sources and subscriptions to PATH and reload them at startup (default off)" << std::endl;
+    std::cerr << "  --state-interval S       seconds between saves, 0 to save only at shutdown (default 10)" << std::endl;
+    std::cerr << "  --handoff PATH           Unix socket to hand the SM over: a new SM started with the same PATH" << std::endl;
+    std::cerr << "                           takes the sockets and state of the running one (default off)" << std::endl;
+    std::cerr << "  --ingest-threads N       threads receiving samples; one source's samples may then be stored out of order (default 1)" << std::endl;
+    std::cerr << "  --fanout-threads N       threads sending to clients, each serving a fixed share of them (default 1)" << std::endl;
+    std::cerr << "  --control-threads N      threads answering client requests (default 4)" << std::endl;
+    std::cerr << "  --cpus ROLE=LIST         pin the ingest, fanout, control or other threads to cores, e.g. fanout=2-3 (default off)" << std::endl;
+    std::cerr << "  --rt-priority P          run the ingest and fanout threads under SCHED_FIFO at priority P (default off)" << std::endl;
+    std::cerr << "  --mlock                  lock the SM's memory in RAM (needs a large enough RLIMIT_MEMLOCK)" << std::endl;
+    std::cerr << "  --max-sources N          distinct sources over the SM's life; samples of later ones are dropped and" << std::endl;
+    std::cerr << "                           the catalog lists at most 2N sources, upstream ones included (default 16384)" << std::endl;
+    std::cerr << "  --max-clients N          clients with subscriptions at a time; a play beyond that is nacked (default 1024)" << std::endl;
+    std::cerr << "  --max-subscriptions N    subscriptions at a time; a play beyond that, or for a 9th view of a source," << std::endl;
+    std::cerr << "                           is nacked (default 16384). Requests beyond " << MAX_REQUEST_QUEUE << " waiting per control thread are dropped" << std::endl;
+    std::cerr << "  --egress-queue N         PDUs queued per client (default 8)" << std::endl;
+    std::cerr << "  --egress-rate R          PDUs per second per client, 0 for no limit (default 0)" << std::endl;
+    std::cerr << "  --egress-burst B         PDUs a client may receive back to back (default 32)" << std::endl;
+    std::cerr << "  --slow-consumer POLICY   drop-oldest, coalesce or disconnect (default drop-oldest)" << std::endl;
+    std::cerr << "  --io BACKEND             socket or uring (default socket; uring falls back to socket)" << std::endl;
+    std::cerr << "  --trace-events N         flight recorder events kept per thread, 0 to turn it off (default 16384)" << std::endl;
+    std::cerr << "  --trace-file PATH        where SIGUSR1 or a dump request (id 9) writes the recorder (default sm.trace)" << std::endl;
+    std::cerr << "  --record-dir DIR         record every source into segment files in DIR (default off)" << std::endl;
+    std::cerr << "  --record-segment-kb N    size preallocated per segment file (default 4096)" << std::endl;
+    std::cerr << "  --record-retention-mb N  disk space the recordings may use (default 1024)" << std::endl;
+    std::cerr << "  --record-retention-s N   delete segments older than this, 0 to keep them (default 0)" << std::endl;
+    std::cerr << "  --replay-rate R          most samples per second sent by one replay (default 20000)" << std::endl;
+}
+
+bool read_options(int argc, char* argv[]) {
+    for (int i = 1; i < argc; i++) {
+        std::string option(argv[i]);
+        if (option == "--mlock") {  // The only option without a value
+            topology.mlock = true;
+            continue;
+        }
+        if (i + 1 >= argc) {
+            std::cerr << "Missing value for " << option << "." << std::endl;
+            return false;
+        }
+        std::string value(argv[++i]);
+        try {
+            if (option == "--ingest-port") {
+                node_config.ingest_port = std::stoi(value);
+            } else if (option == "--control-port") {
+                node_config.control_port = std::stoi(value);
+            } else if (option == "--monitor-port") {
+                node_config.monitor_port = std::stoi(value);
+            } else if (option == "--upstream") {
+                size_t colon = value.rfind(':');
+                if (colon == std::string::npos) {
+                    std::cerr << "The upstream SM is given as IP:PORT." << std::endl;
+                    return false;
+                }
+                node_config.upstream_ip = value.substr(0, colon);
+                node_config.upstream_port = std::stoi(value.substr(colon + 1));
+            } else if (option == "--state-file") {
+                state_config.path = value;
+            } else if (option == "--state-interval") {
+                state_config.interval_s = std::stoul(value);
+            } else if (option == "--handoff") {
+                state_config.handoff_path = value;
+            } else if (option == "--ingest-threads" || option == "--fanout-threads" || option == "--control-threads") {
+                int threads = std::stoi(value);
+                if (threads < 1 || threads > MAX_ROLE_THREADS) {
+                    std::cerr << option << " takes 1 to " << MAX_ROLE_THREADS << " threads." << std::endl;
+                    return false;
+                }
+                (option == "--ingest-threads" ? topology.ingest_threads : option == "--fanout-threads" ? topology.fanout_threads : topology.control_threads) = threads;
+            } else if (option == "--cpus") {
+                size_t equals = value.find('=');
+                std::string role = value.substr(0, equals);
+                int index = std::find(THREAD_ROLE_NAMES, THREAD_ROLE_NAMES + THREAD_ROLES, role) - THREAD_ROLE_NAMES;
+                if (equals == std::string::npos || index == THREAD_ROLES || !parse_cpu_list(value.substr(equals + 1), topology.cpus[index])) {
+                    std::cerr << "Cores are given as ROLE=LIST, e.g. ingest=2 or fanout=4-7,12." << std::endl;
+                    return false;
+                }
+                topology.pinned[index] = true;
+            } else if (option == "--rt-priority") {
+                topology.rt_priority = std::stoi(value);
+            } else if (option == "--max-sources" || option == "--max-clients" || option == "--max-subscriptions") {
+                size_t limit = std::stoul(value);
+                if (limit == 0 || limit > UINT32_MAX / 4) {  // Handles and pool indexes are 32 bits
+                    std::cerr << option << " takes 1 to " << UINT32_MAX / 4 << "." << std::endl;
+                    return false;
+                }
+                (option == "--max-sources" ? capacity_config.max_sources : option == "--max-clients" ? capacity_config.max_clients : capacity_config.max_subscriptions) = limit;
+            } else if (option == "--egress-queue") {
+                egress_config.queue_depth = std::stoul(value);
+                if (egress_config.queue_depth == 0) {
+                    std::cerr << "The egress queue needs at least one position." << std::endl;
+                    return false;
+                }
+            } else if (option == "--egress-rate") {
+                egress_config.rate = std::stod(value);
+            } else if (option == "--egress-burst") {
+                egress_config.burst = std::max(1.0, std::stod(value));
+            } else if (option == "--slow-consumer") {
+                if (value == "drop-oldest") {
+                    egress_config.policy = DROP_OLDEST;
+                } else if (value == "coalesce") {
+                    egress_config.policy = COALESCE;
+                } else if (value == "disconnect") {
+                    egress_config.policy = DISCONNECT;
+                } else {
+                    std::cerr << "Unknown slow consumer policy: " << value << std::endl;
+                    return false;
+                }
+            } else if (option == "--io") {
+                if (value == "socket") {
+                    io_backend = IO_SOCKET;
+                } else if (value == "uring") {
+                    io_backend = IO_URING;
+                } else {
+                    std::cerr << "Unknown I/O backend: " << value << std::endl;
+                    return false;
+                }
+            } else if (option == "--trace-events") {
+                trace_ring_size = std::stoul(value);
+            } else if (option == "--trace-file") {
+                trace_path = value;
+            } else if (option == "--record-dir") {
+                record_config.dir = value;
+            } else if (option == "--record-segment-kb") {
+                record_config.segment_size = std::max<size_t>(std::stoul(value) * 1024, SEGMENT_HEADER_SIZE + 64 * sizeof(SegmentRecord));
+            } else if (option == "--record-retention-mb") {
+                record_config.retention_bytes = std::stoull(value) << 20;
+            } else if (option == "--record-retention-s") {
+                record_config.retention_s = std::stoull(value);
+            } else if (option == "--replay-rate") {
+                record_config.replay_rate = std::max(1.0, std::stod(value));
+            } else {
+                std::cerr << "Unknown option: " << option << std::endl;
+                return false;
+            }
+        } catch (const std::exception& e) {
+            std::cerr << "Invalid value for " << option << ": " << value << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+bool check_topology() {  // Fails fast on a thread topology the host can't honour, before any thread starts
+    for (int role = 0; role < THREAD_ROLES; role++) {
+        int cpu = topology.pinned[role] ? unavailable_cpu(topology.cpus[role]) : -1;
+        if (cpu != -1) {
+            std::cerr << "Core " << cpu << " given to the " << THREAD_ROLE_NAMES[role] << " threads isn't available to the SM." << std::endl;
+            return false;
+        }
+    }
+    if (topology.rt_priority > 0) {
+        std::string problem = check_fifo_priority(topology.rt_priority);
+        if (!problem.empty()) {
+            std::cerr << "Can't use SCHED_FIFO priority " << topology.rt_priority << ": " << problem << "." << std::endl;
+            return false;
+        }
+    }
+    if (topology.mlock && !lock_memory()) {
+        std::cerr << "Can't lock the SM's memory: " << strerror(errno) << "." << std::endl;
+        return false;
+    }
+    return true;
+}
+
+void init_capacity() {  // Sizes every registry from capacity_config once the egress lanes exist, before any source or client
+    size_t max_sources = capacity_config.max_sources;
+    source_slots.clear();
+    source_slots.reserve(max_sources);
+    dirty_sources.clear();
+    dirty_sources.reserve(max_sources);
+    source_handles.init(max_sources);
+    source_views.clear();
+    source_views.resize(max_sources);  // Each source's views are reserved when its first view is played
+    n_active_sources.store(0);
+
+    client_index.init(capacity_config.max_clients);
+    clients.init(capacity_config.max_clients);
+    subscriptions.init(capacity_config.max_subscriptions);
+    n_subscriptions.store(0);
+    egress_pool.clear();
+    for (size_t k = 0; k < 2 * capacity_config.max_clients; k++) {  // Room for removed clients the egress threads still hold
+        std::shared_ptr<EgressQueue> queue = std::make_shared<EgressQueue>();
+        queue->items.resize(egress_config.queue_depth);
+        egress_pool.push_back(queue);
+    }
+    egress_pool_next = 0;
+    for (auto& lane : egress_lanes) {
+        lane->ready.clear();
+        lane->ready.reserve(egress_pool.size());
+    }
+
+    catalog_sources.init(2 * max_sources);  // Ours and as many upstream ones
+    catalog_changes.assign(MAX_CATALOG_CHANGES, CatalogChange());
+    catalog_changes_head = 0;
+    catalog_changes_count = 0;
+    catalog_version = 0;
+    request_queues.clear();
+    for (int k = 0; k < topology.control_threads; k++) {
+        request_queues.emplace_back(new RequestQueue());
+        request_queues.back()->requests.assign(MAX_REQUEST_QUEUE, Request());
+    }
+}
+
+#ifndef SM_NO_MAIN  // Defined by the benchmarks, which include this file for its data path
+int main(int argc, char* argv[]) {
+    if (!read_options(argc, argv)) {
+        print_usage(argv[0]);
+        return 1;
+    }
+    if (io_backend == IO_URING) {
+#ifdef SM_HAVE_IO_URING
+        if (!uring_available()) {
+            std::cerr << "io_uring is not available on this kernel, using plain sockets." << std::endl;
+            io_backend = IO_SOCKET;
+        }
+#else
+        std::cerr << "Built without io_uring support, using plain sockets." << std::endl;
+        io_backend = IO_SOCKET;
+#endif
+    }
+    std::signal(SIGUSR1, [](int) { trace_dump_requested.store(true); });
+    if (!record_config.dir.empty()) {
+        std::error_code error;
+        std::filesystem::create_directories(record_config.dir, error);
+        if (!std::filesystem::is_directory(record_config.dir)) {
+            std::cerr << "Can't use " << record_config.dir << " for recordings." << std::endl;
+            return 1;
+        }
+    }
+    if (!check_topology()) {  // Before taking over from a running SM, which would then be gone
+        return 1;
+    }
+    for (int lane = 0; lane < topology.fanout_threads; lane++) {  // Before any client is added, restored ones included
+        egress_lanes.emplace_back(new EgressLane());
+    }
+    init_capacity();
+    std::signal(SIGINT, [](int) { keep_running.store(false); });  // main then stops the threads and saves the state
+    std::signal(SIGTERM, [](int) { keep_running.store(false); });
+
+    int ingest_sockfd = -1, control_sockfd = -1;
+    std::vector<char> state;
+    int conn = state_config.handoff_path.empty() ? -1 : handoff_connect(state_config.handoff_path);
+    if (conn != -1) {  // An SM runs with the same handoff path: take its sockets and state over
+        int fds[HANDOFF_MAX_FDS];
+        uint32_t n_fds = 0;
+        bool received = handoff_receive(conn, fds, n_fds, state, 10000);
+        close(conn);
+        if (!received || n_fds != 2) {
+            std::cerr << "Failed to take over from the SM on " << state_config.handoff_path << "." << std::endl;
+            return 1;
+        }
+        ingest_sockfd = fds[0];
+        control_sockfd = fds[1];
+        for (auto [sockfd, port] : {std::make_pair(ingest_sockfd, &node_config.ingest_port), std::make_pair(control_sockfd, &node_config.control_port)}) {
+            struct sockaddr_in bound;
+            socklen_t length = sizeof(bound);
+            if (getsockname(sockfd, (struct sockaddr*)&bound, &length) == 0) {
+                *port = ntohs(bound.sin_port);  // The ports are the old SM's, whatever the options say
+            }
+        }
+    } else {
+        struct sockaddr_in ingestAddr, controlAddr;
+        create_receiver_socket(node_config.ingest_port, ingest_sockfd, ingestAddr);
+        create_receiver_socket(node_config.control_port, control_sockfd, controlAddr);
+        if (ingest_sockfd == -1 || control_sockfd == -1) {  // Most likely another SM already has the port
+            std::cerr << "Can't listen on ports " << node_config.ingest_port << " and " << node_config.control_port << "." << std::endl;
+            return 1;
+        }
+        if (!state_config.path.empty()) {
+            snapshot_read(state_config.path, state);
+        }
+    }
+    if (!state.empty() && !restore_state(state)) {
+        std::cerr << "Ignoring a saved state this SM can't read." << std::endl;
+    }
+    int handoff_listenfd = -1;
+    if (!state_config.handoff_path.empty() && (handoff_listenfd = handoff_listen(state_config.handoff_path)) == -1) {
+        std::cerr << "Can't listen for handoffs on " << state_config.handoff_path << "." << std::endl;
+        return 1;
+    }
     try {
-        std::thread receiver_thread(receive_pdu, 12345);
-        std::thread sender_thread(send_pdu, "127.0.0.1", 12347);
-        std::thread manager_thread(manage_client_requests, "127.0.0.1", 12347, 100);
-        std::thread monitor_thread(send_monitor_data, "127.0.0.1", 12365);
+        std::thread recorder;
+        if (!record_config.dir.empty()) {
+            recorder = std::thread(recorder_thread);
+        }
+        std::thread relay;
+        if (!node_config.upstream_ip.empty()) {
+            relay = std::thread(relay_thread);
+        }
+        std::vector<std::thread> receiver_threads;  // All read the same socket
+        ingest_receivers.store(topology.ingest_threads);
+        for (int k = 0; k < topology.ingest_threads; k++) {
+            receiver_threads.emplace_back(receive_pdu, ingest_sockfd);
+        }
+        std::thread sender_thread(send_pdu, "127.0.0.1", node_config.control_port);
+        std::thread manager_thread(manage_client_requests, control_sockfd, 100);
+        std::thread monitor_thread(send_monitor_data, node_config.monitor_ip, node_config.monitor_port);
         std::thread cleaner_thread(cleanup_thread, 1);
+        std::thread handoff;
+        if (handoff_listenfd != -1) {
+            handoff = std::thread(handoff_thread, handoff_listenfd);
+        }
 
-        receiver_thread.join();
+        {
+            // Until a handoff or a failing thread stops the SM; signals can't notify, so they are polled
+            std::unique_lock<std::mutex> lock(stop_mutex);
+            while (keep_running.load()) {
+                stop_cv.wait_for(lock, std::chrono::milliseconds(50));
+            }
+        }
+        stop_threads();
+
+        for (auto& receiver_thread : receiver_threads) {
+            receiver_thread.join();
+        }
         sender_thread.join();
         manager_thread.join();
         monitor_thread.join();
         cleaner_thread.join();
+        if (recorder.joinable()) {
+            recorder.join();
+        }
+        if (relay.joinable()) {
+            relay.join();
+        }
+        if (handoff.joinable()) {
+            handoff.join();
+        }
     } catch (const std::exception& e) {
         std::cerr << "Exception in main: " << e.what() << std::endl;
         keep_running.store(false);
     }
 
+    if (handoff_conn.load() != -1) {  // No thread reads the sockets any more: the new SM can have them
+        int fds[] = {ingest_sockfd, control_sockfd};
+        if (!handoff_send(handoff_conn.load(), fds, 2, encode_state())) {
+            std::cerr << "Failed to hand the SM over." << std::endl;
+        }
+        close(handoff_conn.load());
+    }
+    if (!state_config.path.empty()) {
+        save_state();
+    }
+    close(ingest_sockfd);
+    close(control_sockfd);
+
     return 0;
-}
\ No newline at end of file
+}
+#endif
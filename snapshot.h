@@ -0,0 +1,216 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+/* State carried across SM restarts.
+   A snapshot is a header followed by the source registry (in handle order, so sources keep the
+   handles they send) and the subscriptions with their credits. It is written to a state file on
+   shutdown and at intervals, or handed straight to a new SM process over a Unix socket together
+   with the bound UDP sockets (SCM_RIGHTS), so an upgrade loses neither datagrams nor subscribers. */
+
+#include <poll.h>
+#include <sys/un.h>
+
+#include "api.h"
+
+const char SNAPSHOT_MAGIC[8] = "SMSTATE";
+const uint32_t SNAPSHOT_VERSION = 1;
+
+struct SnapshotHeader {
+    char magic[8];                // SNAPSHOT_MAGIC
+    uint32_t version;             // SNAPSHOT_VERSION
+    uint32_t source_size;         // sizeof(SnapshotSource) de quem escreveu (deteta estruturas diferentes)
+    uint32_t subscription_size;   // sizeof(SnapshotSubscription) de quem escreveu
+    uint32_t n_sources;           // fontes que se seguem (o handle é a posição + 1)
+    uint32_t n_subscriptions;     // subscrições que se seguem
+    uint64_t catalog_version;     // versão do catálogo quando o estado foi guardado
+    int64_t saved_ns;             // relógio de parede quando o estado foi guardado
+};
+
+struct SnapshotSource {
+    PDU_1 pdu;        // última amostra recebida (identificador, frequência, instante)
+    uint8_t active;   // fonte ativa
+    uint8_t relayed;  // fonte retransmitida de um SM acima
+};
+
+struct SnapshotSubscription {
+    char client_id[10];             // identificador do cliente
+    struct sockaddr_in clientAddr;  // endereço do cliente
+    uint32_t source;                // handle da fonte subscrita
+    int32_t credits;                // créditos por gastar
+    View view;                      // vista subscrita
+    Filter filter;                  // predicado de entrega
+};
+
+struct Snapshot {  // A parsed snapshot, pointing into the bytes it was read from
+    SnapshotHeader header;
+    const SnapshotSource* sources;
+    const SnapshotSubscription* subscriptions;
+};
+
+void snapshot_append(std::vector<char>& state, const void* data, size_t size) {
+    const char* bytes = static_cast<const char*>(data);
+    state.insert(state.end(), bytes, bytes + size);
+}
+
+bool snapshot_parse(const std::vector<char>& state, Snapshot& snapshot) {  // false if state isn't a snapshot this build can read
+    if (state.size() < sizeof(SnapshotHeader)) {
+        return false;
+    }
+    memcpy(&snapshot.header, state.data(), sizeof(SnapshotHeader));
+    const SnapshotHeader& header = snapshot.header;
+    if (memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic)) != 0 || header.version != SNAPSHOT_VERSION ||
+        header.source_size != sizeof(SnapshotSource) || header.subscription_size != sizeof(SnapshotSubscription)) {
+        return false;
+    }
+    size_t expected = sizeof(SnapshotHeader) + static_cast<size_t>(header.n_sources) * sizeof(SnapshotSource) +
+                      static_cast<size_t>(header.n_subscriptions) * sizeof(SnapshotSubscription);
+    if (state.size() != expected) {
+        return false;
+    }
+    snapshot.sources = reinterpret_cast<const SnapshotSource*>(state.data() + sizeof(SnapshotHeader));
+    snapshot.subscriptions = reinterpret_cast<const SnapshotSubscription*>(snapshot.sources + header.n_sources);
+    return true;
+}
+
+bool snapshot_write(const std::string& path, const std::vector<char>& state) {
+    // Written next to path and renamed over it, so a crash leaves either the old or the new state
+    std::string temporary = path + ".tmp";
+    int fd = open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+        return false;
+    }
+    bool written = write(fd, state.data(), state.size()) == static_cast<ssize_t>(state.size()) && fsync(fd) == 0;
+    close(fd);
+    if (!written || rename(temporary.c_str(), path.c_str()) == -1) {
+        unlink(temporary.c_str());
+        return false;
+    }
+    return true;
+}
+
+bool snapshot_read(const std::string& path, std::vector<char>& state) {  // false if there is no state file
+    std::ifstream file(path, std::ios::binary);
+    if (!file) {
+        return false;
+    }
+    state.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+    return true;
+}
+
+const uint32_t HANDOFF_MAX_FDS = 4;
+
+struct HandoffHeader {  // Sent with the sockets attached, followed by state_size bytes of snapshot
+    char magic[8];        // SNAPSHOT_MAGIC
+    uint32_t n_fds;       // sockets anexados
+    uint32_t state_size;  // bytes do snapshot que se seguem
+};
+
+bool handoff_address(const std::string& path, struct sockaddr_un& addr) {
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (path.length() >= sizeof(addr.sun_path)) {
+        return false;
+    }
+    memcpy(addr.sun_path, path.c_str(), path.length());
+    return true;
+}
+
+int handoff_listen(const std::string& path) {  // -1 if path can't be bound
+    struct sockaddr_un addr;
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1 || !handoff_address(path, addr)) {
+        if (fd != -1) {
+            close(fd);
+        }
+        return -1;
+    }
+    unlink(path.c_str());  // Left behind by an SM that didn't hand off (e.g. it crashed)
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) == -1 || listen(fd, 1) == -1) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int handoff_connect(const std::string& path) {  // -1 if no SM listens on path
+    struct sockaddr_un addr;
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1 || !handoff_address(path, addr) || connect(fd, (struct sockaddr*)&addr, sizeof(addr)) == -1) {
+        if (fd != -1) {
+            close(fd);
+        }
+        return -1;
+    }
+    return fd;
+}
+
+bool handoff_send(int conn, const int* fds, uint32_t n_fds, const std::vector<char>& state) {
+    if (n_fds == 0 || n_fds > HANDOFF_MAX_FDS) {
+        return false;
+    }
+    HandoffHeader header = {};
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+    header.n_fds = n_fds;
+    header.state_size = state.size();
+    struct iovec iov = {&header, sizeof(header)};
+    char control[CMSG_SPACE(HANDOFF_MAX_FDS * sizeof(int))] = {};
+    struct msghdr msg = {};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = CMSG_SPACE(n_fds * sizeof(int));
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(n_fds * sizeof(int));
+    memcpy(CMSG_DATA(cmsg), fds, n_fds * sizeof(int));
+    if (sendmsg(conn, &msg, MSG_NOSIGNAL) != sizeof(header)) {
+        return false;
+    }
+    size_t sent = 0;
+    while (sent < state.size()) {
+        ssize_t bytes = send(conn, state.data() + sent, state.size() - sent, MSG_NOSIGNAL);
+        if (bytes <= 0) {
+            return false;
+        }
+        sent += bytes;
+    }
+    return true;
+}
+
+bool handoff_receive(int conn, int* fds, uint32_t& n_fds, std::vector<char>& state, int timeout_ms) {
+    // Waits up to timeout_ms for the sockets (the old SM first stops its threads), then reads the snapshot
+    struct pollfd ready = {conn, POLLIN, 0};
+    if (poll(&ready, 1, timeout_ms) != 1) {
+        return false;
+    }
+    HandoffHeader header;
+    struct iovec iov = {&header, sizeof(header)};
+    char control[CMSG_SPACE(HANDOFF_MAX_FDS * sizeof(int))] = {};
+    struct msghdr msg = {};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    if (recvmsg(conn, &msg, MSG_WAITALL | MSG_CMSG_CLOEXEC) != sizeof(header) || memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic)) != 0) {
+        return false;
+    }
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg == nullptr || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+        return false;
+    }
+    n_fds = std::min<uint32_t>((cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int), HANDOFF_MAX_FDS);
+    memcpy(fds, CMSG_DATA(cmsg), n_fds * sizeof(int));
+    state.resize(header.state_size);
+    size_t received = 0;
+    while (received < state.size()) {
+        ssize_t bytes = recv(conn, state.data() + received, state.size() - received, 0);
+        if (bytes <= 0) {
+            return false;
+        }
+        received += bytes;
+    }
+    return true;
+}
+
+#endif
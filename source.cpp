@@ -1,4 +1,5 @@
 #include "api.h"
+#include "topology.h"
 
 int generate_sample(int i, int N) {
     return static_cast<int>(1 + (1 + sin(2 * M_PI * i / N)) * 30);
@@ -12,6 +13,7 @@ PDU_1 generate_pdu(char* id, int i, int P, int F, int N, int M) {
         memcpy(pdu.identifier, id, length);
         pdu.identifier[length] = '\0';
     }
+    pdu.handle = 0;
     pdu.i = i;
     if (P == 0) {
         pdu.value = 0;
@@ -49,22 +51,31 @@ void handler(std::string filename, char* D) {
     std::string IP;
     bool first_iteration = true;
     int F, N, M, port, sockfd;
+    uint32_t handle = 0;  // Assigned by the SM when it first sees this source
     struct sockaddr_in server;
+    PDU_1 reply;
 
     read_config_file(filename, IP, F, N, M, port);
 
     create_sender_socket(IP, port, sockfd, server);
 
     int Fa = F * N;
+    std::chrono::microseconds pace(1000000 / Fa);
+    auto next = std::chrono::steady_clock::now();  // Samples are due on a fixed grid, so printing and sending don't add drift
     while (true) {
         int start_p = first_iteration ? 0 : 1;
         for (int P = start_p; P <= M; P++) {
             for (int i = 0; i < Fa; i++) {
                 PDU_1 pdu = generate_pdu(D, i, P, F, N, M);
+                pdu.handle = handle;
                 print_pdu_1(pdu);
                 std::cout << std::endl;
                 sendto(sockfd, &pdu, sizeof(pdu), 0, (struct sockaddr*)&server, sizeof(server));
-                std::this_thread::sleep_for(std::chrono::microseconds(1000000 / (F * N)));
+                while (recv(sockfd, &reply, sizeof(reply), MSG_DONTWAIT) == sizeof(reply)) {
+                    handle = reply.handle;  // Registration reply from the SM
+                }
+                next += pace;
+                std::this_thread::sleep_until(next);
             }
         }
         first_iteration = false;
@@ -72,7 +83,48 @@ void handler(std::string filename, char* D) {
     close(sockfd);
 }
 
+bool place_source(int argc, char* argv[]) {  // Applies the options after the config file to the sending thread
+    for (int i = 2; i < argc; i++) {
+        std::string option(argv[i]);
+        if (option == "--mlock") {
+            if (!lock_memory()) {
+                std::cerr << "Can't lock the source's memory: " << strerror(errno) << "." << std::endl;
+                return false;
+            }
+            continue;
+        }
+        if (i + 1 >= argc) {
+            std::cerr << "Missing value for " << option << "." << std::endl;
+            return false;
+        }
+        std::string value(argv[++i]);
+        if (option == "--cpus") {
+            cpu_set_t cpus;
+            if (!parse_cpu_list(value, cpus) || unavailable_cpu(cpus) != -1 || !pin_thread(cpus)) {
+                std::cerr << "Can't pin the source to cores " << value << "." << std::endl;
+                return false;
+            }
+        } else if (option == "--rt-priority") {
+            int priority = std::atoi(value.c_str());
+            std::string problem = check_fifo_priority(priority);
+            if (!problem.empty() || !set_fifo_priority(priority)) {
+                std::cerr << "Can't use SCHED_FIFO priority " << value << ": " << problem << "." << std::endl;
+                return false;
+            }
+        } else {
+            std::cerr << "Unknown option: " << option << std::endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+#ifndef SOURCE_NO_MAIN  // Defined by the benchmarks, which include this file for its sample generator
 int main(int argc, char* argv[]) {
+    if (argc < 2 || !place_source(argc, argv)) {
+        std::cerr << "Usage: " << argv[0] << " CONFIG [--cpus LIST] [--rt-priority P] [--mlock]" << std::endl;
+        return 1;
+    }
     std::filesystem::path program_path(argv[0]);
     std::string program_name = program_path.filename().string();
     char* program_name_ptr = new char[program_name.length() + 1];
@@ -80,4 +132,5 @@ int main(int argc, char* argv[]) {
     handler(argv[1], program_name_ptr);
     delete[] program_name_ptr;
     return 0;
-}
\ No newline at end of file
+}
+#endif
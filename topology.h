@@ -0,0 +1,82 @@
+#ifndef TOPOLOGY_H
+#define TOPOLOGY_H
+
+/* CPU placement and scheduling of the data path threads (SM and source).
+   Core sets are given as lists like "2,3" or "4-7,12". Everything here is checked before the
+   threads start, so a topology the host can't honour stops the program instead of running
+   somewhere else than asked. */
+
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+
+#include "api.h"
+
+bool parse_cpu_list(const std::string& list, cpu_set_t& cpus) {  // false if list isn't a valid core set
+    CPU_ZERO(&cpus);
+    size_t start = 0;
+    while (start <= list.size()) {
+        size_t end = std::min(list.find(',', start), list.size());
+        std::string range = list.substr(start, end - start);
+        int first, last;
+        char dash, extra;
+        int n = sscanf(range.c_str(), "%d%c%d%c", &first, &dash, &last, &extra);
+        if (n == 1) {
+            last = first;
+        } else if (n != 3 || dash != '-') {
+            return false;
+        }
+        if (first < 0 || last < first || last >= CPU_SETSIZE) {
+            return false;
+        }
+        for (int cpu = first; cpu <= last; cpu++) {
+            CPU_SET(cpu, &cpus);
+        }
+        start = end + 1;
+    }
+    return true;
+}
+
+int unavailable_cpu(const cpu_set_t& cpus) {  // First core of cpus the process may not run on, -1 if none
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) == -1) {
+        return -1;  // Can't tell: pinning itself will fail if a core is missing
+    }
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, &cpus) && !CPU_ISSET(cpu, &allowed)) {
+            return cpu;
+        }
+    }
+    return -1;
+}
+
+bool pin_thread(const cpu_set_t& cpus) {  // Restricts the calling thread to cpus
+    return pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) == 0;
+}
+
+bool set_fifo_priority(int priority) {  // Moves the calling thread to SCHED_FIFO at priority
+    struct sched_param param = {};
+    param.sched_priority = priority;
+    return pthread_setschedparam(pthread_self(), SCHED_FIFO, &param) == 0;
+}
+
+std::string check_fifo_priority(int priority) {  // Why priority can't be used ("" if it can), tried on the calling thread
+    if (priority < sched_get_priority_min(SCHED_FIFO) || priority > sched_get_priority_max(SCHED_FIFO)) {
+        return "SCHED_FIFO priorities go from " + std::to_string(sched_get_priority_min(SCHED_FIFO)) + " to " +
+               std::to_string(sched_get_priority_max(SCHED_FIFO));
+    }
+    int policy;
+    struct sched_param previous;
+    pthread_getschedparam(pthread_self(), &policy, &previous);
+    if (!set_fifo_priority(priority)) {
+        return "SCHED_FIFO needs CAP_SYS_NICE or a high enough RLIMIT_RTPRIO";
+    }
+    pthread_setschedparam(pthread_self(), policy, &previous);
+    return "";
+}
+
+bool lock_memory() {  // Keeps every page of the process resident, including those mapped later
+    return mlockall(MCL_CURRENT | MCL_FUTURE) == 0;
+}
+
+#endif
@@ -0,0 +1,174 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+/* Flight recorder for the SM hot paths.
+   Every SM thread owns a ring of fixed-size binary events that only it writes, so recording an
+   event is a clock read and a 24 byte store with no lock. The rings are dumped to a file on SIGUSR1
+   or on an admin request; trace_dump turns a dump into a timeline or Chrome trace JSON. */
+
+#include <sys/syscall.h>
+
+#include "api.h"
+
+enum TraceEventType : uint32_t {
+    TRACE_PACKETS_RECEIVED = 1,  // arg: samples in the batch
+    TRACE_FANOUT_START,          // arg: sources with a sample waiting
+    TRACE_FANOUT_END,            // arg: PDUs queued for clients
+    TRACE_CREDITS_EXHAUSTED,     // arg: subscription, value: source
+    TRACE_SUBSCRIBER_ADDED,      // arg: subscription, value: client << 32 | source
+    TRACE_SUBSCRIBER_REMOVED,    // arg: subscription, value: client << 32 | source
+    TRACE_SOURCE_EXPIRED,        // arg: source
+    TRACE_LOCK_WAIT,             // arg: TraceLock, value: nanoseconds waited
+    TRACE_EVENT_TYPES
+};
+
+enum TraceLock : uint32_t { LOCK_SOURCES, LOCK_CLIENTS, LOCK_CATALOG, LOCK_REQUESTS, LOCK_EGRESS, LOCK_RECORD, TRACE_LOCKS };
+
+struct TraceEvent {
+    uint64_t time;   // instante do evento (ns, relógio monotónico)
+    uint64_t value;  // valor que depende do tipo
+    uint32_t arg;    // argumento que depende do tipo
+    uint32_t type;   // TraceEventType
+};
+
+const char TRACE_MAGIC[8] = "SMTRACE";
+const uint32_t TRACE_VERSION = 1;
+
+struct TraceFileHeader {  // Followed by n_threads x (TraceThreadHeader + count TraceEvents, oldest first)
+    char magic[8];          // TRACE_MAGIC
+    uint32_t version;       // TRACE_VERSION
+    uint32_t n_threads;     // threads no ficheiro
+    uint64_t monotonic_ns;  // relógio monotónico no momento do dump
+    uint64_t realtime_ns;   // relógio de parede no mesmo momento (para converter os instantes)
+};
+
+struct TraceThreadHeader {
+    char name[16];  // função do thread
+    uint32_t tid;   // id do thread no sistema
+    uint32_t count; // eventos que se seguem
+    uint64_t lost;  // eventos mais antigos já reescritos no anel
+};
+
+const char* trace_event_name(uint32_t type) {
+    static const char* names[] = {"unknown", "packets_received", "fanout_start", "fanout_end", "credits_exhausted",
+                                  "subscriber_added", "subscriber_removed", "source_expired", "lock_wait"};
+    return type < TRACE_EVENT_TYPES ? names[type] : names[0];
+}
+
+const char* trace_lock_name(uint32_t lock) {
+    static const char* names[] = {"sources_mutex", "client_mutex", "catalog_mutex", "request_mutex", "egress_queue", "record_mutex"};
+    return lock < TRACE_LOCKS ? names[lock] : "unknown";
+}
+
+struct TraceRing {
+    char name[16];                      // função do thread
+    uint32_t tid;                       // id do thread no sistema
+    uint64_t mask;                      // posições - 1 (potência de 2)
+    std::atomic<uint64_t> head{0};      // eventos escritos desde o início
+    std::unique_ptr<TraceEvent[]> events;
+};
+
+const int TRACE_MAX_THREADS = 64;
+size_t trace_ring_size = 16384;  // Events kept per thread (rounded up to a power of 2, 0 turns the recorder off)
+std::mutex trace_mutex;          // Serializes thread registration and dumps
+TraceRing* trace_rings[TRACE_MAX_THREADS];
+std::atomic<int> n_trace_rings(0);
+thread_local TraceRing* trace_ring = nullptr;
+
+uint64_t trace_now() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void trace_thread(const char* name) {  // Gives the calling thread a ring; called once at the top of each SM thread
+    if (trace_ring_size == 0 || trace_ring != nullptr) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(trace_mutex);
+    int n = n_trace_rings.load();
+    if (n == TRACE_MAX_THREADS) {
+        return;  // Later threads simply go unrecorded
+    }
+    size_t size = 1;
+    while (size < trace_ring_size) {
+        size <<= 1;
+    }
+    TraceRing* ring = new TraceRing();  // Lives as long as the process, so a dump never races a free
+    memset(ring->name, 0, sizeof(ring->name));
+    memcpy(ring->name, name, strnlen(name, sizeof(ring->name) - 1));
+    ring->tid = static_cast<uint32_t>(syscall(SYS_gettid));
+    ring->mask = size - 1;
+    ring->events.reset(new TraceEvent[size]());
+    trace_rings[n] = ring;
+    n_trace_rings.store(n + 1);
+    trace_ring = ring;
+}
+
+void trace(uint32_t type, uint32_t arg, uint64_t value = 0) {
+    TraceRing* ring = trace_ring;
+    if (ring == nullptr) {
+        return;
+    }
+    uint64_t head = ring->head.load(std::memory_order_relaxed);
+    // Pairs with the fence in trace_dump: a reader that sees this event's writes also sees the head before it
+    std::atomic_thread_fence(std::memory_order_release);
+    TraceEvent& event = ring->events[head & ring->mask];
+    event.time = trace_now();
+    event.value = value;
+    event.arg = arg;
+    event.type = type;
+    ring->head.store(head + 1, std::memory_order_release);
+}
+
+std::unique_lock<std::mutex> traced_lock(std::mutex& mutex, TraceLock id) {  // Records how long the lock was waited for
+    std::unique_lock<std::mutex> lock(mutex, std::try_to_lock);
+    if (!lock.owns_lock()) {  // Uncontended locks cost no clock reads
+        uint64_t start = trace_now();
+        lock.lock();
+        trace(TRACE_LOCK_WAIT, id, trace_now() - start);
+    }
+    return lock;
+}
+
+bool trace_dump(const std::string& path) {  // Writes every ring to path while the threads keep recording
+    std::lock_guard<std::mutex> lock(trace_mutex);
+    std::ofstream file(path, std::ios::binary | std::ios::trunc);
+    if (!file) {
+        return false;
+    }
+    TraceFileHeader header = {};
+    memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+    header.version = TRACE_VERSION;
+    header.n_threads = n_trace_rings.load();
+    header.monotonic_ns = trace_now();
+    header.realtime_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+    file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+
+    std::vector<TraceEvent> events;
+    for (uint32_t t = 0; t < header.n_threads; t++) {
+        TraceRing& ring = *trace_rings[t];
+        uint64_t size = ring.mask + 1;
+        uint64_t end = ring.head.load(std::memory_order_acquire);
+        uint64_t begin = end > size ? end - size : 0;
+        events.resize(end - begin);
+        for (uint64_t k = begin; k < end; k++) {
+            events[k - begin] = ring.events[k & ring.mask];
+        }
+        // The owner kept writing while we copied: anything it may have overwritten meanwhile is dropped.
+        // The fence keeps the copy above before the second head load (an acquire load alone doesn't)
+        std::atomic_thread_fence(std::memory_order_acquire);
+        uint64_t after = ring.head.load(std::memory_order_relaxed);
+        uint64_t first = after + 1 > size ? std::max(begin, after + 1 - size) : begin;
+        first = std::min(first, end);
+
+        TraceThreadHeader thread = {};
+        memcpy(thread.name, ring.name, sizeof(thread.name));
+        thread.tid = ring.tid;
+        thread.count = static_cast<uint32_t>(end - first);
+        thread.lost = first;
+        file.write(reinterpret_cast<const char*>(&thread), sizeof(thread));
+        file.write(reinterpret_cast<const char*>(events.data() + (first - begin)), thread.count * sizeof(TraceEvent));
+    }
+    return static_cast<bool>(file);
+}
+
+#endif
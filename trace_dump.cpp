@@ -0,0 +1,162 @@
+#include <iomanip>
+
+#include "trace.h"
+
+/* Converts an SM flight recorder dump into a readable timeline (default) or Chrome trace JSON
+   (load it in chrome://tracing or ui.perfetto.dev).
+
+   Usage: trace_dump FILE [--chrome] */
+
+struct ThreadEvent {
+    uint32_t thread;  // índice do thread no ficheiro
+    TraceEvent event;
+};
+
+std::string describe(const TraceEvent& event) {
+    switch (event.type) {
+        case TRACE_PACKETS_RECEIVED:
+            return "samples=" + std::to_string(event.arg);
+        case TRACE_FANOUT_START:
+            return "sources=" + std::to_string(event.arg);
+        case TRACE_FANOUT_END:
+            return "queued=" + std::to_string(event.arg);
+        case TRACE_CREDITS_EXHAUSTED:
+            return "subscription=" + std::to_string(event.arg) + " source=" + std::to_string(event.value);
+        case TRACE_SUBSCRIBER_ADDED:
+        case TRACE_SUBSCRIBER_REMOVED:
+            return "subscription=" + std::to_string(event.arg) + " client=" + std::to_string(event.value >> 32) +
+                   " source=" + std::to_string(event.value & 0xffffffff);
+        case TRACE_SOURCE_EXPIRED:
+            return "source=" + std::to_string(event.arg);
+        case TRACE_LOCK_WAIT:
+            return std::string("lock=") + trace_lock_name(event.arg) + " wait_ns=" + std::to_string(event.value);
+    }
+    return "arg=" + std::to_string(event.arg) + " value=" + std::to_string(event.value);
+}
+
+std::string json_args(const TraceEvent& event) {  // describe() as a JSON object
+    std::string text = describe(event);
+    std::string json = "{";
+    size_t start = 0;
+    while (start < text.size()) {
+        size_t end = text.find(' ', start);
+        if (end == std::string::npos) {
+            end = text.size();
+        }
+        std::string field = text.substr(start, end - start);
+        size_t equals = field.find('=');
+        std::string value = field.substr(equals + 1);
+        bool number = !value.empty() && std::all_of(value.begin(), value.end(), ::isdigit);
+        json += (json.size() > 1 ? "," : "") + ("\"" + field.substr(0, equals) + "\":") + (number ? value : "\"" + value + "\"");
+        start = end + 1;
+    }
+    return json + "}";
+}
+
+void print_timeline(const TraceFileHeader& header, const std::vector<TraceThreadHeader>& threads, const std::vector<ThreadEvent>& events) {
+    for (const auto& thread : threads) {
+        std::cout << "# thread " << thread.name << " (tid " << thread.tid << "): " << thread.count << " events";
+        if (thread.lost > 0) {
+            std::cout << ", " << thread.lost << " older events overwritten";
+        }
+        std::cout << std::endl;
+    }
+    for (const auto& item : events) {
+        const TraceThreadHeader& thread = threads[item.thread];
+        int64_t wall_ns = static_cast<int64_t>(header.realtime_ns) - static_cast<int64_t>(header.monotonic_ns - item.event.time);
+        time_t seconds = wall_ns / 1000000000;
+        char clock[16];
+        strftime(clock, sizeof(clock), "%H:%M:%S", localtime(&seconds));
+        char fraction[16];
+        snprintf(fraction, sizeof(fraction), ".%09lld", static_cast<long long>(wall_ns % 1000000000));
+        std::cout << clock << fraction << "  " << std::left << std::setw(8) << thread.name << std::setw(6) << thread.tid << "  "
+                  << std::setw(19) << trace_event_name(item.event.type) << " " << describe(item.event) << std::endl;
+    }
+}
+
+void print_chrome(const std::vector<TraceThreadHeader>& threads, const std::vector<ThreadEvent>& events) {
+    uint64_t origin = UINT64_MAX;  // Lock waits may have started before the first recorded event
+    for (const auto& item : events) {
+        origin = std::min(origin, item.event.time - (item.event.type == TRACE_LOCK_WAIT ? item.event.value : 0));
+    }
+    auto micros = [origin](uint64_t ns) { return std::to_string((ns - origin) / 1000) + "." + std::to_string((ns - origin) / 100 % 10); };
+    std::cout << "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[" << std::endl;
+    bool first = true;
+    auto emit = [&first](const std::string& line) {
+        std::cout << (first ? "" : ",\n") << line;
+        first = false;
+    };
+    for (const auto& thread : threads) {
+        emit("{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" + std::to_string(thread.tid) + ",\"args\":{\"name\":\"" +
+             thread.name + "\"}}");
+    }
+    for (const auto& item : events) {
+        const TraceEvent& event = item.event;
+        std::string common = ",\"pid\":1,\"tid\":" + std::to_string(threads[item.thread].tid) + ",\"args\":" + json_args(event) + "}";
+        switch (event.type) {
+            case TRACE_FANOUT_START:
+                emit("{\"name\":\"fanout\",\"ph\":\"B\",\"ts\":" + micros(event.time) + common);
+                break;
+            case TRACE_FANOUT_END:
+                emit("{\"name\":\"fanout\",\"ph\":\"E\",\"ts\":" + micros(event.time) + common);
+                break;
+            case TRACE_LOCK_WAIT:  // Recorded once the lock was taken, so the wait ends at event.time
+                emit("{\"name\":\"wait " + std::string(trace_lock_name(event.arg)) + "\",\"ph\":\"X\",\"ts\":" +
+                     micros(event.time - event.value) +
+                     ",\"dur\":" + std::to_string(event.value / 1000.0) + common);
+                break;
+            default:
+                emit("{\"name\":\"" + std::string(trace_event_name(event.type)) + "\",\"ph\":\"i\",\"s\":\"t\",\"ts\":" +
+                     micros(event.time) + common);
+        }
+    }
+    std::cout << "\n]}" << std::endl;
+}
+
+int main(int argc, char* argv[]) {
+    if (argc < 2 || (argc == 3 && std::string(argv[2]) != "--chrome") || argc > 3) {
+        std::cerr << "Usage: " << argv[0] << " FILE [--chrome]" << std::endl;
+        return 1;
+    }
+    std::ifstream file(argv[1], std::ios::binary);
+    if (!file) {
+        std::cerr << "Failed to open " << argv[1] << "." << std::endl;
+        return 1;
+    }
+    TraceFileHeader header;
+    if (!file.read(reinterpret_cast<char*>(&header), sizeof(header)) || memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic)) != 0) {
+        std::cerr << argv[1] << " is not an SM trace." << std::endl;
+        return 1;
+    }
+    if (header.version != TRACE_VERSION) {
+        std::cerr << "Unsupported trace version " << header.version << "." << std::endl;
+        return 1;
+    }
+
+    std::vector<TraceThreadHeader> threads(header.n_threads);
+    std::vector<ThreadEvent> events;
+    for (uint32_t t = 0; t < header.n_threads; t++) {
+        TraceThreadHeader& thread = threads[t];
+        if (!file.read(reinterpret_cast<char*>(&thread), sizeof(thread))) {
+            std::cerr << "Truncated trace." << std::endl;
+            return 1;
+        }
+        thread.name[sizeof(thread.name) - 1] = '\0';
+        for (uint32_t k = 0; k < thread.count; k++) {
+            ThreadEvent item = {t, {}};
+            if (!file.read(reinterpret_cast<char*>(&item.event), sizeof(item.event))) {
+                std::cerr << "Truncated trace." << std::endl;
+                return 1;
+            }
+            events.push_back(item);
+        }
+    }
+    std::stable_sort(events.begin(), events.end(), [](const ThreadEvent& a, const ThreadEvent& b) { return a.event.time < b.event.time; });
+
+    if (argc == 3) {
+        print_chrome(threads, events);
+    } else {
+        print_timeline(header, threads, events);
+    }
+    return 0;
+}
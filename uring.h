@@ -0,0 +1,259 @@
+#ifndef URING_H
+#define URING_H
+
+/* Minimal io_uring wrapper over the raw syscalls (no liburing needed).
+   Only what the SM uses: multishot recvmsg into a provided buffer ring and batched sendmsg.
+   Build with -DSM_NO_IO_URING to leave it out; SM_HAVE_IO_URING tells whether it is available. */
+
+#if defined(__linux__) && __has_include(<linux/io_uring.h>) && !defined(SM_NO_IO_URING)
+#define SM_HAVE_IO_URING 1
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "api.h"
+
+struct Uring {
+    int fd = -1;                        // descritor do anel
+    unsigned sq_entries = 0;            // posições na fila de submissão
+    unsigned* sq_head = nullptr;        // cabeça da fila de submissão (escrita pelo kernel)
+    unsigned* sq_tail = nullptr;        // cauda da fila de submissão (escrita por nós)
+    unsigned* sq_mask = nullptr;
+    unsigned* sq_array = nullptr;
+    unsigned* cq_head = nullptr;        // cabeça da fila de conclusão (escrita por nós)
+    unsigned* cq_tail = nullptr;        // cauda da fila de conclusão (escrita pelo kernel)
+    unsigned* cq_mask = nullptr;
+    struct io_uring_sqe* sqes = nullptr;
+    struct io_uring_cqe* cqes = nullptr;
+    void* sq_ptr = nullptr;             // zonas mapeadas do kernel
+    void* cq_ptr = nullptr;
+    size_t sq_size = 0;
+    size_t cq_size = 0;
+    size_t sqes_size = 0;
+    unsigned pending = 0;               // SQEs preparados e ainda não submetidos
+};
+
+struct UringBufRing {
+    struct io_uring_buf_ring* ring = nullptr;  // anel partilhado com o kernel
+    char* buffers = nullptr;                   // memória dos buffers
+    unsigned entries = 0;                      // número de buffers (potência de 2)
+    size_t buf_size = 0;                       // tamanho de cada buffer
+    size_t ring_size = 0;
+    uint16_t bgid = 0;                         // grupo de buffers
+    uint16_t tail = 0;                         // cauda local do anel
+};
+
+bool uring_init(Uring& ring, unsigned entries) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    ring.fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (ring.fd < 0) {
+        return false;
+    }
+    ring.sq_entries = params.sq_entries;
+    ring.sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring.cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        ring.sq_size = ring.cq_size = std::max(ring.sq_size, ring.cq_size);
+    }
+    ring.sq_ptr = mmap(nullptr, ring.sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQ_RING);
+    if (ring.sq_ptr == MAP_FAILED) {
+        close(ring.fd);
+        ring.fd = -1;
+        return false;
+    }
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        ring.cq_ptr = ring.sq_ptr;
+    } else {
+        ring.cq_ptr = mmap(nullptr, ring.cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_CQ_RING);
+        if (ring.cq_ptr == MAP_FAILED) {
+            munmap(ring.sq_ptr, ring.sq_size);
+            close(ring.fd);
+            ring.fd = -1;
+            return false;
+        }
+    }
+    ring.sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    void* sqes = mmap(nullptr, ring.sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) {
+        if (ring.cq_ptr != ring.sq_ptr) {
+            munmap(ring.cq_ptr, ring.cq_size);
+        }
+        munmap(ring.sq_ptr, ring.sq_size);
+        close(ring.fd);
+        ring.fd = -1;
+        return false;
+    }
+    char* sq = static_cast<char*>(ring.sq_ptr);
+    char* cq = static_cast<char*>(ring.cq_ptr);
+    ring.sq_head = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+    ring.sq_tail = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+    ring.sq_mask = reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+    ring.sq_array = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+    ring.cq_head = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+    ring.cq_tail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+    ring.cq_mask = reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+    ring.cqes = reinterpret_cast<struct io_uring_cqe*>(cq + params.cq_off.cqes);
+    ring.sqes = static_cast<struct io_uring_sqe*>(sqes);
+    ring.pending = 0;
+    return true;
+}
+
+void uring_exit(Uring& ring) {
+    if (ring.fd < 0) {
+        return;
+    }
+    munmap(ring.sqes, ring.sqes_size);
+    if (ring.cq_ptr != ring.sq_ptr) {
+        munmap(ring.cq_ptr, ring.cq_size);
+    }
+    munmap(ring.sq_ptr, ring.sq_size);
+    close(ring.fd);
+    ring.fd = -1;
+}
+
+struct io_uring_sqe* uring_get_sqe(Uring& ring) {  // nullptr when the submission queue is full
+    unsigned head = __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE);
+    unsigned tail = *ring.sq_tail + ring.pending;
+    if (tail - head >= ring.sq_entries) {
+        return nullptr;
+    }
+    unsigned index = tail & *ring.sq_mask;
+    struct io_uring_sqe* sqe = &ring.sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    ring.sq_array[index] = index;
+    ring.pending++;
+    return sqe;
+}
+
+int uring_submit(Uring& ring, unsigned wait_nr) {  // Publishes the prepared SQEs and waits for wait_nr completions
+    unsigned to_submit = ring.pending;
+    if (to_submit > 0) {
+        __atomic_store_n(ring.sq_tail, *ring.sq_tail + to_submit, __ATOMIC_RELEASE);
+        ring.pending = 0;
+    }
+    if (to_submit == 0 && wait_nr == 0) {
+        return 0;
+    }
+    int result;
+    do {
+        result = syscall(__NR_io_uring_enter, ring.fd, to_submit, wait_nr, wait_nr > 0 ? IORING_ENTER_GETEVENTS : 0, nullptr, 0);
+    } while (result < 0 && errno == EINTR);
+    return result;
+}
+
+struct io_uring_cqe* uring_peek_cqe(Uring& ring) {  // nullptr when no completion is ready
+    unsigned head = *ring.cq_head;
+    if (head == __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE)) {
+        return nullptr;
+    }
+    return &ring.cqes[head & *ring.cq_mask];
+}
+
+void uring_cqe_seen(Uring& ring) {
+    __atomic_store_n(ring.cq_head, *ring.cq_head + 1, __ATOMIC_RELEASE);
+}
+
+void uring_recycle_buffer(UringBufRing& buf_ring, uint16_t bid) {  // Gives a buffer back to the kernel
+    // Not ring->bufs: in C++ the header's flexible array wrapper moves it 8 bytes past the ring start
+    struct io_uring_buf* buf = reinterpret_cast<struct io_uring_buf*>(buf_ring.ring) + (buf_ring.tail & (buf_ring.entries - 1));
+    buf->addr = reinterpret_cast<uint64_t>(buf_ring.buffers + bid * buf_ring.buf_size);
+    buf->len = buf_ring.buf_size;
+    buf->bid = bid;
+    buf_ring.tail++;
+    __atomic_store_n(&buf_ring.ring->tail, buf_ring.tail, __ATOMIC_RELEASE);
+}
+
+bool uring_setup_buf_ring(Uring& ring, UringBufRing& buf_ring, uint16_t bgid, unsigned entries, size_t buf_size) {
+    // entries must be a power of two; the buffers are registered once and recycled after each use
+    buf_ring.entries = entries;
+    buf_ring.buf_size = buf_size;
+    buf_ring.bgid = bgid;
+    buf_ring.tail = 0;
+    buf_ring.ring_size = entries * sizeof(struct io_uring_buf);
+    void* memory = mmap(nullptr, buf_ring.ring_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED) {
+        return false;
+    }
+    buf_ring.ring = static_cast<struct io_uring_buf_ring*>(memory);
+    buf_ring.buffers = static_cast<char*>(mmap(nullptr, entries * buf_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+    if (buf_ring.buffers == MAP_FAILED) {
+        munmap(memory, buf_ring.ring_size);
+        return false;
+    }
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = reinterpret_cast<uint64_t>(memory);
+    reg.ring_entries = entries;
+    reg.bgid = bgid;
+    if (syscall(__NR_io_uring_register, ring.fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        munmap(buf_ring.buffers, entries * buf_size);
+        munmap(memory, buf_ring.ring_size);
+        return false;
+    }
+    for (unsigned bid = 0; bid < entries; bid++) {
+        uring_recycle_buffer(buf_ring, bid);
+    }
+    return true;
+}
+
+void uring_free_buf_ring(UringBufRing& buf_ring) {
+    if (buf_ring.ring != nullptr) {
+        munmap(buf_ring.buffers, buf_ring.entries * buf_ring.buf_size);
+        munmap(buf_ring.ring, buf_ring.ring_size);
+        buf_ring.ring = nullptr;
+    }
+}
+
+void uring_prep_recvmsg_multishot(struct io_uring_sqe* sqe, int sockfd, struct msghdr* msg, uint16_t bgid, uint64_t user_data) {
+    // One SQE keeps producing a CQE per datagram (while IORING_CQE_F_MORE is set)
+    sqe->opcode = IORING_OP_RECVMSG;
+    sqe->fd = sockfd;
+    sqe->addr = reinterpret_cast<uint64_t>(msg);
+    sqe->len = 1;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = bgid;
+    sqe->user_data = user_data;
+}
+
+void uring_prep_sendmsg(struct io_uring_sqe* sqe, int sockfd, const struct msghdr* msg, uint64_t user_data) {
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = sockfd;
+    sqe->addr = reinterpret_cast<uint64_t>(msg);
+    sqe->len = 1;
+    sqe->user_data = user_data;
+}
+
+bool uring_recvmsg_payload(const UringBufRing& buf_ring, const struct io_uring_cqe* cqe, const struct msghdr& msg,
+                           struct sockaddr_in& addr, char*& payload, size_t& length) {
+    // Splits a multishot recvmsg buffer into the sender address and the datagram
+    uint16_t bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+    char* buffer = buf_ring.buffers + bid * buf_ring.buf_size;
+    struct io_uring_recvmsg_out* out = reinterpret_cast<struct io_uring_recvmsg_out*>(buffer);
+    if (static_cast<size_t>(cqe->res) < sizeof(*out) + msg.msg_namelen + msg.msg_controllen || (out->flags & MSG_TRUNC)) {
+        return false;
+    }
+    memset(&addr, 0, sizeof(addr));
+    memcpy(&addr, buffer + sizeof(*out), std::min<size_t>(out->namelen, sizeof(addr)));
+    payload = buffer + sizeof(*out) + msg.msg_namelen + msg.msg_controllen;
+    length = out->payloadlen;
+    return true;
+}
+
+bool uring_available() {  // Whether this kernel lets us create a ring with provided buffer rings
+    Uring ring;
+    if (!uring_init(ring, 4)) {
+        return false;
+    }
+    UringBufRing buf_ring;
+    bool available = uring_setup_buf_ring(ring, buf_ring, 0, 2, 64);
+    uring_free_buf_ring(buf_ring);
+    uring_exit(ring);
+    return available;
+}
+
+#endif
+
+#endif